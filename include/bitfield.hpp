@@ -0,0 +1,52 @@
+#ifndef BITFIELD_HPP
+#define BITFIELD_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Piece bitfield stored in wire order: piece 0 is the high bit of byte 0,
+ * exactly as it appears in a BITFIELD message, so payloads are memcpy'd in
+ * and out. Storage is padded to whole 64-bit words and the spare bits are
+ * kept at zero, which lets the set operations and popcounts below run a
+ * word at a time (plain loops the compiler vectorizes).
+ */
+class Bitfield {
+private:
+	std::vector<uint64_t> words;
+	size_t num_bits;
+
+	uint8_t *bytes() { return reinterpret_cast<uint8_t*>(words.data()); }
+	const uint8_t *bytes() const { return reinterpret_cast<const uint8_t*>(words.data()); }
+	void clear_spare_bits();
+
+public:
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	explicit Bitfield(size_t bits = 0);
+
+	size_t size() const { return num_bits; }
+	size_t wire_size() const { return (num_bits + 7) / 8; }
+
+	bool test(size_t index) const;
+	void set(size_t index);
+	void reset(size_t index);
+
+	size_t count() const;
+	bool all() const { return count() == num_bits; }
+
+	/* Wire (de)serialization, extra bytes are ignored and missing ones read as zero */
+	void assign_wire(const char *data, size_t len);
+	std::string to_wire() const;
+
+	/* Bits set here and clear in `ours`, i.e. pieces a peer has that we lack */
+	bool has_missing(const Bitfield &ours) const;
+	size_t count_missing(const Bitfield &ours) const;
+
+	/* First bit set here and clear in both `a` and `b`, or npos */
+	size_t find_first_missing(const Bitfield &a, const Bitfield &b) const;
+};
+
+#endif /* bitfield.hpp */
@@ -0,0 +1,50 @@
+#ifndef CLUSTER_FRONT_HPP
+#define CLUSTER_FRONT_HPP
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <hash_ring.hpp>
+
+#define FRONT_LINKS_PER_NODE 4 /* keep-alive connections from the front to each node */
+#define FRONT_NODE_TIMEOUT 5 /* seconds a node may take to answer before its link is reset */
+#define FRONT_MAX_ATTEMPTS 2 /* sends per request, so an idle-closed link is retried once */
+
+class NodeLink;
+
+/*
+ * Front listener of a tracker cluster. Every node is an ordinary tracker
+ * process owning the torrents that the hash ring maps to it; the front
+ * only looks at each request's info_hash and passes it on, over a few
+ * pipelined keep-alive connections per node, adding an X-Forwarded-For
+ * header so the node records the client's address rather than ours.
+ *
+ * A scrape that names torrents on several nodes is split into one scrape
+ * per node and the answers are merged back into a single "files" dict.
+ */
+class ClusterFront {
+private:
+	boost::asio::ip::tcp::acceptor acceptor;
+	HashRing ring;
+	std::vector<std::vector<std::shared_ptr<NodeLink>>> links; /* [node][link] */
+	std::atomic<size_t> next_link{0};
+
+	void do_accept();
+
+public:
+	/* nodes are "host:port" strings, resolved once here */
+	ClusterFront(boost::asio::io_context &io, uint16_t port, const std::vector<std::string> &nodes);
+	~ClusterFront();
+
+	void start();
+
+	size_t node_count() const { return links.size(); }
+	size_t owner(const Id20 &info_hash) const { return ring.owner(info_hash); }
+
+	/* A node's links are used round-robin, they all run on their own strands */
+	NodeLink &link_for(size_t node);
+};
+
+#endif /* cluster_front.hpp */
@@ -0,0 +1,82 @@
+#ifndef EXPIRY_WHEEL_HPP
+#define EXPIRY_WHEEL_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <ctime>
+#include <flat_map.hpp>
+
+/*
+ * Timing wheel of peer deadlines with one slot per second. Announces drop
+ * an entry into the slot of their deadline; advance() walks only the
+ * slots that have come due since the last call, so expiry costs the
+ * number of deadlines passed rather than the size of the tracker.
+ *
+ * Entries are never removed or moved when a peer re-announces. When one
+ * comes due the owner checks it against the live peer record and either
+ * drops it or returns a later deadline to re-queue it at, so each peer
+ * has a single entry no matter how often it announces.
+ */
+class ExpiryWheel {
+public:
+	struct Entry {
+		uint32_t deadline;
+		Id20 info_hash;
+		Id20 peer_id;
+	};
+
+private:
+	std::vector<std::vector<Entry>> slots;
+	std::vector<Entry> requeue; /* scratch for advance() */
+	time_t current; /* every slot up to and including this second is processed */
+
+public:
+	/*
+	 * span should cover the usual deadline, in seconds. Longer ones still
+	 * work, they are just passed over once per lap until they are due.
+	 */
+	ExpiryWheel(int span, time_t now);
+
+	/* Returns the deadline actually used (anything already past is moved up) */
+	time_t schedule(time_t deadline, const Id20 &info_hash, const Id20 &peer_id);
+
+	/* on_due(entry) returns the entry's next deadline, or 0 to drop it */
+	template<typename Callback>
+	void advance(time_t now, Callback &&on_due);
+};
+
+template<typename Callback>
+void ExpiryWheel::advance(time_t now, Callback &&on_due)
+{
+	/* After a long stall every slot is visited once, not once per second missed */
+	time_t first = std::max(current + 1, now - static_cast<time_t>(slots.size()) + 1);
+	for (time_t second = first; second <= now; second++) {
+		std::vector<Entry> &slot = slots[second % slots.size()];
+		size_t kept = 0;
+		for (size_t i = 0; i < slot.size(); i++) {
+			if (slot[i].deadline <= now) {
+				time_t next = on_due(static_cast<const Entry&>(slot[i]));
+				if (next) {
+					requeue.push_back(slot[i]);
+					requeue.back().deadline = static_cast<uint32_t>(next);
+				}
+			} else {
+				if (kept != i) {
+					slot[kept] = std::move(slot[i]);
+				}
+				kept++;
+			}
+		}
+		slot.resize(kept);
+	}
+	current = std::max(current, now);
+
+	/* Re-queued after the sweep, since the new slot may be one still being walked */
+	for (const Entry &entry : requeue) {
+		schedule(entry.deadline, entry.info_hash, entry.peer_id);
+	}
+	requeue.clear();
+}
+
+#endif /* expiry_wheel.hpp */
@@ -0,0 +1,205 @@
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <array>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+/* info_hashes and peer_ids, kept as raw bytes rather than std::strings */
+using Id20 = std::array<char, 20>;
+
+/*
+ * Peer ids share a fixed client prefix ("-PC0001-"), so every byte has to
+ * be mixed in, not just the leading word.
+ */
+inline uint64_t hash_id20(const Id20 &id)
+{
+	uint64_t a, b, c;
+	std::memcpy(&a, id.data(), 8);
+	std::memcpy(&b, id.data() + 8, 8);
+	std::memcpy(&c, id.data() + 12, 8);
+	uint64_t h = (a ^ 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ b ^ (h >> 31)) * 0x94d049bb133111ebULL;
+	h = (h ^ c ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+/*
+ * Open-addressing hash map from Id20 to V: one flat array of (key, value)
+ * slots with linear probing, so a lookup is a hash and a short scan of
+ * adjacent memory with no per-entry allocation. Erase shifts later
+ * entries of the probe run back instead of leaving tombstones.
+ *
+ * Pointers returned by find/insert are invalidated by the next insert
+ * or erase.
+ */
+template<typename V>
+class FlatMap {
+private:
+	struct Slot {
+		Id20 key;
+		V value;
+	};
+
+	std::vector<Slot> slots;
+	std::vector<uint8_t> used;
+	size_t count = 0;
+
+	size_t home(const Id20 &key) const { return hash_id20(key) & (slots.size() - 1); }
+	size_t locate(const Id20 &key) const; /* slot holding key, or slots.size() */
+	void rehash(size_t capacity);
+
+public:
+	V *find(const Id20 &key);
+	const V *find(const Id20 &key) const;
+
+	/* The value for key, default-constructed if absent; second is true if it was */
+	std::pair<V*, bool> insert(const Id20 &key);
+	bool erase(const Id20 &key);
+	/* Size the table for n entries up front, e.g. before a bulk load */
+	void reserve(size_t n);
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	template<typename Callback>
+	void for_each(Callback &&cb) const;
+	/* Same walk with mutable values; keys stay const, as they place the slot */
+	template<typename Callback>
+	void for_each(Callback &&cb);
+};
+
+template<typename V>
+size_t FlatMap<V>::locate(const Id20 &key) const
+{
+	if (count == 0) {
+		return slots.size();
+	}
+	size_t mask = slots.size() - 1;
+	for (size_t i = home(key); used[i]; i = (i + 1) & mask) {
+		if (slots[i].key == key) {
+			return i;
+		}
+	}
+	return slots.size();
+}
+
+template<typename V>
+void FlatMap<V>::rehash(size_t capacity)
+{
+	std::vector<Slot> old_slots(capacity);
+	std::vector<uint8_t> old_used(capacity, 0);
+	old_slots.swap(slots);
+	old_used.swap(used);
+
+	size_t mask = capacity - 1;
+	for (size_t j = 0; j < old_slots.size(); j++) {
+		if (!old_used[j]) continue;
+		size_t i = home(old_slots[j].key);
+		while (used[i]) i = (i + 1) & mask;
+		slots[i] = std::move(old_slots[j]);
+		used[i] = 1;
+	}
+}
+
+template<typename V>
+V *FlatMap<V>::find(const Id20 &key)
+{
+	size_t i = locate(key);
+	return i == slots.size() ? nullptr : &slots[i].value;
+}
+
+template<typename V>
+const V *FlatMap<V>::find(const Id20 &key) const
+{
+	size_t i = locate(key);
+	return i == slots.size() ? nullptr : &slots[i].value;
+}
+
+template<typename V>
+std::pair<V*, bool> FlatMap<V>::insert(const Id20 &key)
+{
+	size_t i = locate(key);
+	if (i != slots.size()) {
+		return {&slots[i].value, false};
+	}
+
+	/* Keep the load under 7/8 so probe runs stay short */
+	if ((count + 1) * 8 > slots.size() * 7) {
+		rehash(slots.empty() ? 8 : slots.size() * 2);
+	}
+
+	size_t mask = slots.size() - 1;
+	for (i = home(key); used[i]; i = (i + 1) & mask);
+	slots[i].key = key;
+	used[i] = 1;
+	count++;
+	return {&slots[i].value, true};
+}
+
+template<typename V>
+bool FlatMap<V>::erase(const Id20 &key)
+{
+	size_t i = locate(key);
+	if (i == slots.size()) {
+		return false;
+	}
+
+	/* Pull back any later entry whose home slot doesn't lie between the hole and itself */
+	size_t mask = slots.size() - 1;
+	for (size_t j = (i + 1) & mask; used[j]; j = (j + 1) & mask) {
+		size_t h = home(slots[j].key);
+		bool stays = (i <= j) ? (i < h && h <= j) : (i < h || h <= j);
+		if (!stays) {
+			slots[i] = std::move(slots[j]);
+			i = j;
+		}
+	}
+	slots[i] = Slot();
+	used[i] = 0;
+	count--;
+
+	if (slots.size() > 16 && count * 8 < slots.size()) {
+		rehash(slots.size() / 2);
+	}
+	return true;
+}
+
+template<typename V>
+void FlatMap<V>::reserve(size_t n)
+{
+	size_t capacity = slots.empty() ? 8 : slots.size();
+	while (n * 8 > capacity * 7) {
+		capacity *= 2;
+	}
+	if (capacity != slots.size()) {
+		rehash(capacity);
+	}
+}
+
+template<typename V>
+template<typename Callback>
+void FlatMap<V>::for_each(Callback &&cb) const
+{
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (used[i]) {
+			cb(slots[i].key, slots[i].value);
+		}
+	}
+}
+
+template<typename V>
+template<typename Callback>
+void FlatMap<V>::for_each(Callback &&cb)
+{
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (used[i]) {
+			cb(static_cast<const Id20 &>(slots[i].key), slots[i].value);
+		}
+	}
+}
+
+#endif /* flat_map.hpp */
@@ -0,0 +1,30 @@
+#ifndef HASH_RING_HPP
+#define HASH_RING_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <flat_map.hpp>
+
+#define RING_POINTS_PER_NODE 128 /* virtual nodes, evens out each node's share */
+
+/*
+ * Consistent hashing of info_hashes onto cluster nodes. Every node is
+ * placed on a 64-bit ring at RING_POINTS_PER_NODE points derived from its
+ * name, and a torrent belongs to the first point at or after its
+ * info_hash. Adding or removing a node only moves the torrents on the
+ * arcs it gains or loses; everything else keeps its owner.
+ */
+class HashRing {
+private:
+	std::vector<std::pair<uint64_t, size_t>> points; /* sorted (position, node index) */
+
+public:
+	/* Node names (e.g. "127.0.0.1:7001") in index order; must not be empty */
+	explicit HashRing(const std::vector<std::string> &nodes);
+
+	size_t owner(const Id20 &info_hash) const;
+};
+
+#endif /* hash_ring.hpp */
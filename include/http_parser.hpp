@@ -0,0 +1,65 @@
+#ifndef HTTP_PARSER_HPP
+#define HTTP_PARSER_HPP
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Single-pass parsing of tracker requests straight out of the receive
+ * buffer. Nothing here allocates: strings are views into the buffer and
+ * are only valid until it is reused.
+ */
+
+enum HttpParseResult {
+	HTTP_PARSE_OK,
+	HTTP_PARSE_INCOMPLETE, /* no blank line yet, read more */
+	HTTP_PARSE_ERROR
+};
+
+struct HttpRequest {
+	std::string_view method;
+	std::string_view path;
+	std::string_view query;
+	bool keep_alive; /* HTTP/1.1 unless "Connection: close", HTTP/1.0 only if asked */
+	std::string_view forwarded_for; /* first X-Forwarded-For address, set by a cluster front */
+};
+
+struct AnnounceRequest {
+	std::array<char, 20> info_hash;
+	std::array<char, 20> peer_id;
+	uint16_t port = 0;
+	int64_t uploaded = 0;
+	int64_t downloaded = 0;
+	int64_t left = 0;
+	bool has_left = false; /* clients that leave it out are not taken for seeds */
+	std::string_view event;
+	bool compact = false;
+	int numwant = -1;
+};
+
+/* Parse one request head from data; consumed is set to its length on success */
+HttpParseResult parse_http_request(const char *data, size_t len, HttpRequest &req, size_t &consumed);
+
+/*
+ * Parse one complete "200 OK" response with a Content-Length, as the
+ * tracker sends them; body and consumed are set on success. Any other
+ * status is an error.
+ */
+HttpParseResult parse_http_response(const char *data, size_t len, std::string_view &body, size_t &consumed);
+
+/* Append a 200 response carrying body, with a Connection header matching keep_alive */
+void append_response(std::string &out, std::string_view body, bool keep_alive);
+
+/* Pop the next key=value pair off query, values still percent-encoded */
+bool next_query_param(std::string_view &query, std::string_view &key, std::string_view &value);
+
+/* Percent-decode into exactly out_len bytes, false if the decoded size differs */
+bool url_decode_fixed(std::string_view in, char *out, size_t out_len);
+
+/* Returns nullptr on success, otherwise what was wrong with the announce */
+const char *parse_announce_query(std::string_view query, AnnounceRequest &req);
+
+#endif /* http_parser.hpp */
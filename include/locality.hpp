@@ -0,0 +1,48 @@
+#ifndef LOCALITY_HPP
+#define LOCALITY_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <peer_record.hpp>
+#include <flat_map.hpp>
+
+#define LOCALITY_OVERSAMPLE 4 /* candidates drawn per peer wanted, for ranking */
+#define LOCALITY_REMOTE_SHARE 0.2 /* of a response kept for peers outside the caller's zone */
+
+/*
+ * Which zone (rack, data center, region) an address belongs to, so
+ * responses can prefer peers that are cheap to reach. Zones come from a
+ * map file of subnets, longest prefix winning, and/or from fixed prefix
+ * lengths, where every /24 (say) is a zone of its own. Zone 0 means
+ * unknown and is never treated as local.
+ */
+class Locality {
+private:
+	int prefix4 = 0; /* 0: not grouping by prefix */
+	int prefix6 = 0;
+	FlatMap<uint32_t> subnets; /* subnet_key() -> zone from the map file */
+	std::vector<int> lengths4; /* prefix lengths present in subnets, longest first */
+	std::vector<int> lengths6;
+	size_t num_zones = 0;
+
+	/* Family, length and the masked address packed into an Id20, so FlatMap can hold it */
+	static Id20 subnet_key(const std::array<uint8_t, 16> &addr, bool ipv6, int length);
+
+public:
+	/* Peers sharing the leading v4 / v6 bits are local to each other; 0 turns a family off */
+	void set_prefixes(int v4, int v6);
+
+	/*
+	 * One "<subnet>[/<length>] <zone>" per line, '#' starts a comment.
+	 * Throws std::runtime_error naming the line on anything malformed.
+	 */
+	void load_zone_map(const std::string &path);
+
+	bool enabled() const { return prefix4 > 0 || prefix6 > 0 || !subnets.empty(); }
+	size_t zone_count() const { return num_zones; }
+
+	uint64_t zone_of(const PeerRecord &peer) const;
+};
+
+#endif /* locality.hpp */
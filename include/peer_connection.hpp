@@ -2,11 +2,14 @@
 #define PEER_CONNECTION_HPP
 
 #include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
 #include <string>
 #include <vector>
 #include <cstdint>
 #include "peer_info.hpp"
 #include "torrent_state.hpp"
+#include "bitfield.hpp"
 
 enum PEER_MSG {
 	MSG_CHOKE,
@@ -23,17 +26,29 @@ enum PEER_MSG {
 class PeerConnection {
 private:
 
-	/* Connection */
+	/* Connection; the socket is only touched by the thread running io */
+    boost::asio::io_context& io;
     boost::asio::ip::tcp::socket socket;
     PeerInfo peer_info;
     TorrentState& torrent_state;
+    bool closed;
+
+    /* Messages waiting to go out, written one at a time */
+    std::deque<std::string> send_queue;
+    size_t queued_bytes;
+    bool writing;
+
+    /* The message being read; reading pauses while too much is queued to send */
+    uint32_t read_length_be;
+    std::string read_buffer;
+    bool read_paused;
 
 	/* Torrent Protocol info */
     std::string our_peer_id;
     std::string info_hash;
 
 	/* Peer state information */
-    std::vector<bool> peer_bitfield;
+    Bitfield peer_bitfield;
     bool am_choking;
     bool am_interested;
     bool peer_choking;
@@ -49,8 +64,8 @@ private:
     void send_not_interested();
     void send_choke();
     void send_unchoke();
-    void send_request(int index, int begin, int length);
-    void send_piece(int index, int begin, const std::string& data);
+    void send_request(int index, uint32_t begin, uint32_t length);
+    void send_piece(int index, uint32_t begin, const std::string& data);
     void send_have(int index);
 
     void handle_message(uint8_t msg_id, const std::string& payload);
@@ -64,7 +79,10 @@ private:
     void handle_piece(const std::string& payload);
 
     void download_next_piece();
-    bool peer_has_piece(int index) const;
+
+    void complete_within(std::chrono::seconds timeout, boost::system::error_code& ec);
+    void read_message();
+    void write_next();
 
 public:
     PeerConnection(
@@ -75,20 +93,33 @@ public:
         const std::string& hash
     );
 
+    /*
+     * Everything below runs io on the calling thread, so each connection
+     * needs an io_context of its own and one thread to drive it. Connect
+     * and handshakes give up after timeout, closing the socket.
+     */
+
     /* For outgoing connections (we initiate) */
-    void connect();
+    void connect(std::chrono::seconds timeout);
 
-    /* For incoming connections (they initiated, we have socket) */
-    void start_with_socket(boost::asio::ip::tcp::socket socket);
+    /* For incoming connections (they initiated): take over an accepted socket's descriptor */
+    void start_with_socket(const boost::asio::ip::tcp& protocol,
+                           boost::asio::ip::tcp::socket::native_handle_type fd);
 
     /* Protocol */
-    void send_handshake();
-	void receive_handshake();
+    void send_handshake(std::chrono::seconds timeout);
+	void receive_handshake(std::chrono::seconds timeout);
 	std::vector<uint8_t> build_handshake();
 	void validate_handshake(const std::vector<uint8_t> &response);
 
-    /* Main message loop (run in thread) */
+    /* Main message loop, until the peer goes away or close() */
     void run();
+
+    /* Safe from any thread: posted to io, it aborts whatever the connection is waiting on */
+    void close();
+
+    /* The other side's peer_id, empty until its handshake has been validated */
+    const std::string& remote_peer_id() const { return peer_info.peer_id; }
 };
 
 #endif
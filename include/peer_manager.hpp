@@ -0,0 +1,104 @@
+#ifndef PEER_MANAGER_HPP
+#define PEER_MANAGER_HPP
+
+#include <boost/asio.hpp>
+#include <peer_info.hpp>
+#include <torrent_state.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define PEER_TARGET_ACTIVE 30 /* connections kept up while downloading, either direction */
+#define PEER_MAX_ACTIVE 60 /* incoming connections past this many are turned away */
+#define PEER_MAX_DIALING 8 /* outgoing connects in progress at once */
+#define PEER_CONNECT_TIMEOUT 5 /* seconds */
+#define PEER_HANDSHAKE_TIMEOUT 5 /* seconds, for each direction's handshake */
+#define PEER_RETRY_MIN 10 /* seconds before dialing a peer again, doubled per failure */
+#define PEER_RETRY_MAX 900
+#define PEER_MAX_FAILURES 8 /* failures in a row before a candidate is forgotten */
+#define PEER_MAX_CANDIDATES 2000
+
+class PeerConnection;
+
+/* A peer address we could dial, from any tracker answer */
+struct PeerCandidate {
+	PeerInfo info;
+	std::string peer_id; /* from its handshake, once we have reached it */
+	bool dialing = false;
+	bool connected = false;
+	int failures = 0;
+	std::chrono::steady_clock::time_point next_attempt; /* not before this; epoch means now */
+
+	explicit PeerCandidate(const PeerInfo &peer) : info(peer) {}
+};
+
+/*
+ * Owns the client's peer connections, each still a thread of its own.
+ * Every tracker answer feeds a pool of candidate addresses. While the
+ * download is incomplete a dialer thread keeps PEER_TARGET_ACTIVE
+ * connections up, dialing at most PEER_MAX_DIALING at a time with a
+ * PEER_CONNECT_TIMEOUT each, preferring candidates that have failed least.
+ * A peer that connects but doesn't handshake within PEER_HANDSHAKE_TIMEOUT,
+ * either way round, is dropped so it can't hold a dialing or incoming slot.
+ * A failed candidate waits PEER_RETRY_MIN seconds, doubling per failure
+ * (+-25% jitter), and is forgotten after PEER_MAX_FAILURES in a row.
+ *
+ * Connections are keyed by the remote peer_id from the handshake, so an
+ * incoming and an outgoing connection to the same peer, or the same peer
+ * at two addresses, end up as one: whichever registered first stays.
+ * Reaching ourselves through a tracker's list is dropped the same way.
+ */
+class PeerManager {
+private:
+	TorrentState &state;
+	std::string our_peer_id;
+	std::string info_hash;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::unordered_map<std::string, PeerCandidate> candidates; /* by "ip:port" */
+	std::unordered_map<std::string, PeerConnection*> connections; /* by remote peer_id */
+	std::unordered_set<PeerConnection*> live; /* every connection object, for stop() */
+	size_t dialing = 0;
+	size_t incoming = 0; /* accepted, handshake not done yet */
+	size_t threads = 0; /* dial and serve_incoming threads still running */
+	bool stopping = false;
+	std::mt19937 rng;
+	std::thread dialer;
+
+	void run_dialer();
+	void dial(std::string key, PeerInfo peer);
+	void serve_incoming(boost::asio::ip::tcp protocol, boost::asio::ip::tcp::socket::native_handle_type fd);
+	bool track(PeerConnection &conn);
+	void thread_finished();
+	bool register_connection(PeerConnection &conn);
+	void connection_ended(PeerConnection &conn, bool registered);
+	std::chrono::steady_clock::time_point retry_time(int failures);
+
+public:
+	PeerManager(TorrentState &state, const std::string &our_peer_id, const std::string &info_hash);
+	~PeerManager();
+	PeerManager(const PeerManager&) = delete;
+	PeerManager& operator=(const PeerManager&) = delete;
+
+	/* Safe from any thread, e.g. the tracker client's */
+	void add_candidates(const std::vector<PeerInfo> &peers);
+
+	/* Take over an accepted connection, unless we are at PEER_MAX_ACTIVE */
+	void accept(boost::asio::ip::tcp::socket sock);
+
+	size_t active_count();
+
+	void start();
+
+	/* Stop dialing, close every connection and wait, without a deadline, for all their threads to end */
+	void stop();
+};
+
+#endif /* peer_manager.hpp */
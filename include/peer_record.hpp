@@ -0,0 +1,52 @@
+#ifndef PEER_RECORD_HPP
+#define PEER_RECORD_HPP
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <boost/asio/ip/address.hpp>
+#include <flat_map.hpp>
+
+/* Announce events, numbered as on the UDP tracker wire (BEP 15) */
+enum PeerEvent : uint8_t {
+	EVENT_NONE = 0,
+	EVENT_COMPLETED = 1,
+	EVENT_STARTED = 2,
+	EVENT_STOPPED = 3
+};
+
+PeerEvent parse_event(std::string_view event);
+
+#define PEER_IPV6 0x01
+#define PEER_SEED 0x02 /* announced left=0 */
+
+/*
+ * What the tracker keeps per peer: 48 bytes, no heap allocations. The
+ * address stays binary (IPv4 in the first 4 bytes), which is also the
+ * form compact responses want, and times are 32-bit seconds.
+ */
+struct PeerRecord {
+	Id20 peer_id;
+	std::array<uint8_t, 16> addr;
+	uint16_t port = 0;
+	uint8_t event = EVENT_NONE; /* last event announced */
+	uint8_t flags = 0;
+	uint32_t valid_until = 0; /* dropped after this, unless it announces again */
+	uint32_t expires = 0; /* deadline of this peer's entry in the expiry wheel */
+
+	void set_address(const boost::asio::ip::address &ip);
+	std::string ip_string() const;
+
+	bool ipv6() const { return flags & PEER_IPV6; }
+	bool seed() const { return flags & PEER_SEED; }
+
+	/* BEP 23 / BEP 7 entry: 4 or 16 address bytes then the port, network order */
+	void append_compact(std::string &out) const;
+	/* bencoded {"ip", "peer id", "port"} */
+	void append_dict(std::string &out) const;
+};
+
+static_assert(sizeof(PeerRecord) == 48, "PeerRecord should stay packed");
+
+#endif /* peer_record.hpp */
@@ -0,0 +1,119 @@
+#ifndef SWARM_HPP
+#define SWARM_HPP
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <peer_record.hpp>
+#include <flat_map.hpp>
+#include <locality.hpp>
+
+#define DICT_FRAGMENT_MAX 99 /* "d2:ip45:<IPv6 text>7:peer id20:<id>4:porti65535ee" */
+
+/*
+ * Peers announcing one torrent. The vector keeps their records dense so
+ * responses can sample random slots; the index maps peer_id to its slot
+ * so upsert and remove are O(1) (removal moves the last peer into the
+ * hole). Seeds are kept ahead of leechers, slots below num_seeders, so
+ * either kind can be sampled on its own.
+ *
+ * Compact entries are copied straight out of the records. Dict entries
+ * are encoded once per peer, into a fixed-size fragment beside its slot
+ * that moves with it; a swarm only starts keeping them (100 bytes a
+ * peer) the first time a sampled dict response needs them. Swarms small
+ * enough to be returned whole also keep their compact and dict entries
+ * concatenated in slot order, rebuilt only after the membership changes,
+ * so such a response is a couple of memcpys in either form. Whole
+ * response bodies aren't cached: each leaves out its caller and starts
+ * at a random slot, so no two are the same bytes.
+ *
+ * The seeder, leecher and download counts move with every upsert and
+ * removal, so scraping a swarm never walks its peers. Announces are
+ * counted too, and folded into a smoothed rate once a tick, from which
+ * the tracker stretches this torrent's interval.
+ *
+ * When only part of the swarm can be returned, seeds for leechers and
+ * leechers for seeds are drawn first, straight from their side of the
+ * split. With zones configured, a few times more candidates than wanted
+ * are drawn instead and ranked: same zone as the caller first (keeping
+ * LOCALITY_REMOTE_SHARE for other zones), and within each zone side the
+ * peers of the other kind first.
+ */
+class Swarm {
+private:
+	struct FragmentList {
+		std::string bytes;
+		std::vector<uint32_t> offsets; /* slot i spans offsets[i] .. offsets[i + 1] */
+	};
+
+	struct DictFragment {
+		uint8_t size;
+		char bytes[DICT_FRAGMENT_MAX];
+	};
+
+	std::vector<PeerRecord> peers;
+	FlatMap<uint32_t> index;
+	uint32_t num_seeders = 0;
+	uint32_t num_ipv6 = 0;
+	uint32_t num_downloaded = 0; /* leechers that announced "completed" */
+	uint32_t tick_announces = 0; /* since the last tick_rate() */
+	float rate = 0; /* announces per second, smoothed */
+	float stretch = 1; /* of the tracker-wide interval, set by the tracker */
+
+	uint64_t version = 0;
+	mutable uint64_t cached_version = UINT64_MAX;
+	mutable FragmentList cached_peers;
+	mutable FragmentList cached_peers6;
+	mutable FragmentList cached_dicts;
+	mutable std::vector<DictFragment> dicts; /* one per slot once kept, else empty */
+
+	void remove_at(size_t slot);
+	void swap_slots(size_t a, size_t b);
+	size_t slot_of(const Id20 &peer_id) const;
+	size_t random_start(std::mt19937 &rng) const;
+	void sample_range(size_t count, size_t begin, size_t end, size_t skip, std::mt19937 &rng,
+					  std::vector<const PeerRecord*> &out) const;
+	void refresh_cache() const;
+	void encode_dict(size_t slot) const;
+	void keep_dicts() const;
+	static void append_rotated(const FragmentList &list, size_t start, size_t skip, std::string &out);
+	void select(size_t count, const PeerRecord &caller, const Locality &locality,
+				std::mt19937 &rng, std::vector<const PeerRecord*> &out) const;
+
+public:
+	/* Insert or refresh a peer; returns true if it is new to the swarm */
+	bool upsert(const PeerRecord &peer);
+	bool remove(const Id20 &peer_id);
+	PeerRecord *find(const Id20 &peer_id);
+	void reserve(size_t count) { peers.reserve(count); index.reserve(count); }
+
+	/* Up to count distinct peers other than exclude_id, uniformly at random */
+	void sample(size_t count, const Id20 &exclude_id, std::mt19937 &rng,
+				std::vector<const PeerRecord*> &out) const;
+
+	/* Append the bencoded "peers" (and "peers6") entries of an announce response for caller */
+	void append_peers(bool compact, size_t numwant, const PeerRecord &caller, const Locality &locality,
+					  std::mt19937 &rng, std::string &out) const;
+
+	/* Bare BEP 15 peer list of the caller's address family, no bencode framing */
+	void append_compact(size_t numwant, const PeerRecord &caller, const Locality &locality,
+						std::mt19937 &rng, std::string &out) const;
+
+	const std::vector<PeerRecord> &records() const { return peers; }
+	size_t size() const { return peers.size(); }
+	bool empty() const { return peers.empty(); }
+	size_t seeders() const { return num_seeders; }
+	size_t leechers() const { return peers.size() - num_seeders; }
+	size_t downloaded() const { return num_downloaded; }
+	void set_downloaded(uint32_t count) { num_downloaded = count; }
+
+	void count_announce() { tick_announces++; }
+	/* Fold the announces counted over the last `seconds` into the rate */
+	void tick_rate(double seconds);
+	double announce_rate() const { return rate; }
+	double interval_stretch() const { return stretch; }
+	void set_interval_stretch(double factor) { stretch = static_cast<float>(factor); }
+};
+
+#endif /* swarm.hpp */
@@ -2,24 +2,41 @@
 #define TORRENT_METADATA_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 
 class TorrentMetadata {
 public:
     std::string announce_url;
+    /* BEP 12 announce-list tiers, in preference order; just announce_url without one */
+    std::vector<std::vector<std::string>> announce_tiers;
     std::string info_hash;
     std::string file_name;
     int64_t file_length;
     int64_t piece_length;
-    std::vector<std::string> piece_hashes;
+    std::string_view piece_hashes; /* num_pieces SHA1 digests back to back, in the mapped file */
     int num_pieces;
 
     TorrentMetadata(const std::string& torrent_filename);
+    ~TorrentMetadata();
+
+    /* Shared read-only between threads, never copied */
+    TorrentMetadata(const TorrentMetadata&) = delete;
+    TorrentMetadata& operator=(const TorrentMetadata&) = delete;
+
+    std::string_view piece_hash(int index) const;
+    int64_t piece_offset(int index) const;
+    int64_t piece_size(int index) const;
     void print_info() const;
 private:
-    void parse(const std::string& torrent_filename);
-    void calculate_info_hash(const std::string& bencoded_info);
+    const char *mapped_data;
+    size_t mapped_size;
+
+    void map_file(const std::string& torrent_filename);
+    void unmap_file();
+    void parse(std::string_view contents);
+    void calculate_info_hash(std::string_view bencoded_info);
 };
 
 #endif /* torrent_metadata.hpp */
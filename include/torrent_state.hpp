@@ -2,32 +2,62 @@
 #define TORRENT_STATE_HPP
 
 #include <torrent_metadata.hpp>
+#include <bitfield.hpp>
+#include <atomic>
+#include <memory>
 #include <mutex>
 
+/*
+ * How the payload file is laid out on first run. Preallocating reserves
+ * every block up front so out-of-order pieces don't fragment the file;
+ * sparse just sets the length and lets the filesystem allocate on write.
+ */
+enum StorageMode {
+	STORAGE_PREALLOCATE,
+	STORAGE_SPARSE,
+};
+
 class TorrentState {
 private:
-	std::vector<bool> done_bmap;
-	std::vector<bool> in_progress_bmap;
+	Bitfield done_bmap;
+	Bitfield in_progress_bmap;
 	std::mutex state_mutex;
-	TorrentMetadata metadata;
+	std::shared_ptr<const TorrentMetadata> metadata;
 	std::string file_path;
-	std::mutex file_mutex;
+	int file_fd; /* pread/pwrite are positional, so no file lock is needed */
+	std::atomic<int64_t> uploaded_bytes{0}; /* piece payload this session, for the tracker */
+	std::atomic<int64_t> downloaded_bytes{0};
+
+	void open_file();
+	void allocate_file(StorageMode mode);
 
 public:
-    TorrentState(const TorrentMetadata &meta, const std::string &path);
+    TorrentState(std::shared_ptr<const TorrentMetadata> meta, const std::string &path,
+				 StorageMode mode = STORAGE_PREALLOCATE);
+	~TorrentState();
+	TorrentState(const TorrentState&) = delete;
+	TorrentState& operator=(const TorrentState&) = delete;
+
 	bool verify_piece(int index, const std::string &piece_string);
 	bool have_piece(int index);
-	int get_next_piece_to_download();
+	int get_next_piece_to_download(const Bitfield &peer_bitfield);
 	void set_in_progress(int index);
+	void clear_in_progress(int index);
 	void set_complete(int index);
-	std::vector<bool> get_bitfield();
+	bool is_interesting(const Bitfield &peer_bitfield);
+	std::string get_wire_bitfield();
 	void write_piece(int index, const std::string &data);
 	std::string read_piece(int index);
 	bool is_file_complete();
-	int bytes_left();
+	int64_t bytes_left();
+	void add_uploaded(int64_t n);
+	void add_downloaded(int64_t n);
+	int64_t uploaded();
+	int64_t downloaded();
 	int get_total_pieces();
-	int get_piece_length();
-	TorrentMetadata get_metadata();
+	int64_t get_piece_length();
+	int64_t get_piece_size(int index);
+	const TorrentMetadata &get_metadata();
 };
 
 #endif /* torrent_state.hpp */
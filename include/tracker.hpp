@@ -1,31 +1,190 @@
 #ifndef TRACKER_HPP
 #define TRACKER_HPP
 
-#include <unordered_map>
+#include <mutex>
+#include <memory>
 #include <vector>
-#include <peer_info.hpp>
+#include <atomic>
+#include <random>
+#include <peer_record.hpp>
+#include <flat_map.hpp>
+#include <swarm.hpp>
+#include <locality.hpp>
+#include <expiry_wheel.hpp>
 
-#define ANNOUNCE_INTERVAL 30
-#define PEER_TIMEOUT 120
+#define ANNOUNCE_INTERVAL 30 /* at light load; stretched as load grows */
+#define PEER_TIMEOUT 120 /* at ANNOUNCE_INTERVAL, scaled with the interval a peer was given */
+#define MAX_ANNOUNCE_INTERVAL 600
+#define INTERVAL_JITTER 0.1 /* +-10%, so peers that joined together drift apart */
+#define TARGET_ANNOUNCE_RATE 50000 /* announces per second the interval aims to stay under */
+#define TARGET_CPU_LOAD 0.75 /* share of all cores above which intervals stretch further */
+#define BUSY_SWARM_STRETCH 2.0 /* most a torrent's own announce rate stretches its interval */
+#define DEFAULT_NUMWANT 50 /* peers returned when the client doesn't say */
+#define MAX_NUMWANT 200
+#define TRACKER_SHARDS 64 /* torrent table slices, each with its own lock */
+#define RETIRED_SWARM_TTL 86400 /* seconds an emptied swarm's download count outlives its last scrape */
+#define RETIRED_SWEEP_INTERVAL 60 /* seconds between expire_peers() sweeps of those counts */
 
+struct ScrapeStats {
+	size_t complete = 0;   /* seeders */
+	size_t downloaded = 0; /* completed events */
+	size_t incomplete = 0; /* leechers */
+};
+
+/* Whole-tracker counts, see Tracker::totals() */
+struct TrackerTotals {
+	size_t torrents = 0;
+	size_t peers = 0;
+	size_t seeders = 0;
+};
+
+/* One announce as the journal records it (see tracker_store.hpp) */
+struct JournalEntry {
+	Id20 info_hash;
+	PeerRecord peer; /* with valid_until filled in */
+};
+
+static_assert(sizeof(JournalEntry) == 68, "JournalEntry is written to disk as is");
+
+/*
+ * Announces arrive on every io thread. The torrent table is split into
+ * shards by info_hash, each with its own lock, map and expiry wheel, so
+ * announces for different torrents almost never wait on each other.
+ */
 class Tracker {
 private:
-	std::unordered_map<std::string, std::vector<PeerInfo>> torrents;
+	/* Dropped RETIRED_SWARM_TTL after the swarm emptied or was last scraped; an announce revives it */
+	struct RetiredSwarm {
+		uint32_t downloaded;
+		uint32_t touched;
+	};
+
+	/* Aligned so neighbouring shards' locks never share a cache line */
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		FlatMap<Swarm> torrents;
+		FlatMap<RetiredSwarm> retired_downloads; /* download counts of swarms that emptied */
+		ExpiryWheel expiry;
+		std::vector<JournalEntry> journal; /* announces not yet handed to the store */
+		size_t num_peers = 0;
+		uint64_t announces = 0; /* since the last update_load() */
+
+		Shard(int span, time_t now) : expiry(span, now) {}
+	};
+
+	std::vector<std::unique_ptr<Shard>> shards;
+	time_t next_retired_sweep = 0; /* only expire_peers() reads or writes it */
 	int announce_interval;
 	int peer_timeout;
+	bool journaling = false; /* set before any io thread starts */
+
+	/* Load control, see update_load(); only the scaled interval is read by announces */
+	int target_rate = TARGET_ANNOUNCE_RATE;
+	std::atomic<int> scaled_interval;
+	double load_factor = 1.0;
+	double cpu_factor = 1.0;
+	double announce_rate = 0.0;
+
+	Locality locality; /* set before any io thread starts */
+
+	Shard &shard_for(const Id20 &info_hash) const;
+	static void erase_swarm(Shard &shard, const Id20 &info_hash);
+
+	/* Callers hold the shard's mutex; returns the swarm, or nullptr if it is gone */
+	Swarm *update_swarm(Shard &shard, const Id20 &info_hash, const PeerRecord &peer);
+	/* Pick the peer's interval, journal it, then update_swarm() with the matching valid_until */
+	Swarm *record_announce(Shard &shard, const Id20 &info_hash, PeerRecord peer,
+						   std::mt19937 &rng, int &interval);
+	int interval_for(const Swarm *swarm, std::mt19937 &rng) const;
+	void generate_response(const Swarm *swarm, const PeerRecord &caller, bool compact,
+						   int numwant, int interval, std::mt19937 &rng, std::string &out);
 
 public:
-	Tracker(int interval = ANNOUNCE_INTERVAL, int timeout = PEER_TIMEOUT);
-
-	std::string handle_announce(const std::string &info_hash,
-								const std::string &peer_id,
-								const std::string &ip,
-								uint16_t port,
-								const std::string &event);
-	std::string generate_response(const std::string &info_hash, const std::string &caller_id);
-	void cleanup_inactive_peers();
-	void update_peer(const std::string &info_hash, const PeerInfo &peer);
-	int get_peer_count(const std::string &info_hash) const;
+	Tracker(int interval = ANNOUNCE_INTERVAL, int timeout = PEER_TIMEOUT,
+			int num_shards = TRACKER_SHARDS);
+
+	/*
+	 * Record an announce and append the bencoded response body to out.
+	 * peer carries the id, address, port, event and seed flag; the
+	 * tracker fills in the times.
+	 */
+	void handle_announce(const Id20 &info_hash, const PeerRecord &peer,
+						 bool compact, int numwant, std::string &out);
+
+	/*
+	 * Same announce for the UDP protocol (BEP 15): appends interval,
+	 * leechers, seeders and then bare 6-byte (or 18-byte, for an IPv6
+	 * peer) entries.
+	 */
+	void handle_udp_announce(const Id20 &info_hash, const PeerRecord &peer,
+							 int numwant, std::string &out);
+
+	/* O(1): read off the swarm's counters */
+	ScrapeStats scrape(const Id20 &info_hash) const;
+
+	/*
+	 * Append a bencoded scrape response ("files" dict) for info_hashes,
+	 * which is sorted and deduplicated in place since dict keys must be.
+	 * Unknown torrents are reported with zero counts.
+	 */
+	void handle_scrape(std::vector<Id20> &info_hashes, std::string &out) const;
+
+	/* Walks every swarm, one shard lock at a time; for metrics, not the hot path */
+	TrackerTotals totals() const;
+
+	/* Drop peers whose deadline has passed, called about once a second */
+	size_t expire_peers();
+
+	/*
+	 * Re-derive the announce interval, called about once a second with
+	 * the share of all cores the process used since the last call. The
+	 * interval grows so that the announce rate the current peers would
+	 * make stays under the target rate, and further while the CPU stays
+	 * above TARGET_CPU_LOAD; it relaxes back as load falls. Each swarm's
+	 * announce rate is folded in on the same call and sets how far that
+	 * torrent's interval is stretched beyond the shared one.
+	 */
+	void update_load(double seconds, double cpu_load);
+	void set_target_rate(int rate) { target_rate = std::max(1, rate); }
+	int current_interval() const { return scaled_interval.load(std::memory_order_relaxed); }
+	double current_announce_rate() const { return announce_rate; }
+
+	/* Zones for ranking peers in responses; without one, all peers are equally near */
+	void set_locality(const Locality &zones) { locality = zones; }
+
+	/*
+	 * Hooks for TrackerStore. Once journaling is on, every announce is
+	 * also queued in its shard's journal until drain_journal() moves it
+	 * to out. snapshot_shard() hands every torrent of one shard to
+	 * on_torrent(info_hash, downloaded, peers, count) under the shard's
+	 * lock and discards that shard's queued announces, which the
+	 * snapshot now covers.
+	 */
+	void enable_journal() { journaling = true; }
+	void drain_journal(std::vector<JournalEntry> &out);
+	size_t shard_count() const { return shards.size(); }
+	template<typename Callback>
+	void snapshot_shard(size_t index, Callback &&on_torrent);
+
+	/* Loading side: peers past their timeout are dropped, not restored; nothing is journaled */
+	size_t restore_swarm(const Id20 &info_hash, uint32_t downloaded,
+						 const PeerRecord *peers, size_t count);
+	void replay_announce(const JournalEntry &entry);
 };
 
+template<typename Callback>
+void Tracker::snapshot_shard(size_t index, Callback &&on_torrent)
+{
+	Shard &shard = *shards[index];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.torrents.for_each([&](const Id20 &info_hash, const Swarm &swarm) {
+		on_torrent(info_hash, static_cast<uint32_t>(swarm.downloaded()),
+				   swarm.records().data(), swarm.size());
+	});
+	shard.retired_downloads.for_each([&](const Id20 &info_hash, const RetiredSwarm &retired) {
+		on_torrent(info_hash, retired.downloaded, nullptr, 0);
+	});
+	shard.journal.clear();
+}
+
 #endif /* tracker.hpp */
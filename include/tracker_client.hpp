@@ -0,0 +1,198 @@
+#ifndef TRACKER_CLIENT_HPP
+#define TRACKER_CLIENT_HPP
+
+#include <boost/asio.hpp>
+#include <peer_info.hpp>
+#include <torrent_state.hpp>
+#include <udp_tracker.hpp>
+#include <utils.hpp>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#define TRACKER_TIMEOUT 15 /* seconds for a whole HTTP exchange, or a first UDP try */
+#define TRACKER_UDP_RETRIES 3 /* BEP 15: the nth try waits TRACKER_TIMEOUT * 2^n */
+#define TRACKER_RESOLVE_TTL 300 /* seconds a DNS answer is reused */
+#define TRACKER_RETRY_MIN 5 /* seconds before retrying a failed announce, doubled per failure */
+#define TRACKER_RETRY_MAX 600
+#define TRACKER_STOP_TIMEOUT 5 /* seconds shutdown waits for the stopped announces */
+#define TRACKER_FAILOVER_TIMEOUT 5 /* seconds a tier has to answer before the next is tried too */
+#define TRACKER_MAX_RESPONSE (1 << 20)
+
+struct tracker_resp {
+	std::vector<PeerInfo> peer_list;
+	long long interval = 0;
+	long long min_interval = 0; /* optional; the tracker's floor for announcing again */
+};
+
+/* What one announce reports, sampled when it is sent */
+struct AnnounceParams {
+	std::string info_hash;
+	std::string peer_id;
+	uint16_t port = 0;
+	int64_t uploaded = 0;
+	int64_t downloaded = 0;
+	int64_t left = 0;
+	std::string event; /* "started", "completed", "stopped" or empty */
+};
+
+/* Accepts both the compact peer string and the original list of dicts; throws on failure */
+tracker_resp parse_tracker_response(std::string_view body);
+
+/*
+ * One tracker, over HTTP or UDP by the URL's scheme, with one announce in
+ * flight at a time. What is worth keeping between announces is kept: the
+ * resolved address for TRACKER_RESOLVE_TTL, the HTTP connection (kept
+ * alive, reopened once if the tracker dropped it while idle) and the UDP
+ * connection id for UDP_CONNECTION_TTL. Every announce runs against a
+ * deadline, and all of it runs on the io_context's thread.
+ */
+class TrackerConnection : public std::enable_shared_from_this<TrackerConnection> {
+public:
+	/* error is empty on success */
+	using Handler = std::function<void(const std::string &error, tracker_resp resp)>;
+
+private:
+	std::string announce_url;
+	URL url;
+	boost::asio::ip::tcp::resolver resolver;
+	std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+	std::chrono::steady_clock::time_point resolved_until;
+	boost::asio::steady_timer deadline;
+	bool timed_out = false;
+	bool cancelled = false;
+	Handler handler;
+	AnnounceParams params;
+
+	/* HTTP */
+	boost::asio::ip::tcp::socket tcp_socket;
+	bool reusing = false; /* the request went out on a connection kept from before */
+	std::string request;
+	std::string response;
+
+	/* UDP */
+	boost::asio::ip::udp::socket udp_socket;
+	uint64_t connection_id = 0;
+	std::chrono::steady_clock::time_point connection_until;
+	std::array<unsigned char, UDP_MAX_PACKET> reply;
+	std::array<unsigned char, 98> packet;
+	uint32_t transaction_id = 0;
+	std::mt19937 rng;
+
+	void resolve(std::function<void()> next);
+	void arm_deadline(int seconds);
+	std::string error_text(const boost::system::error_code &ec, const std::string &doing) const;
+
+	void http_announce();
+	void http_connect();
+	void http_write();
+	void http_read();
+
+	void udp_announce();
+	void udp_send_connect();
+	void udp_send_announce(bool cached);
+	/* on_reply(error, reply length); the length is nonzero on error if the tracker sent one */
+	using UdpHandler = std::function<void(const std::string &error, size_t len)>;
+	void udp_transact(size_t len, int attempt, UdpHandler on_reply);
+	void udp_receive(size_t len, int attempt, UdpHandler on_reply);
+
+	void fail(const std::string &error);
+	void finish(const std::string &error, tracker_resp resp);
+
+public:
+	TrackerConnection(boost::asio::io_context &io, const std::string &announce_url);
+
+	/* handler runs exactly once, on the io_context's thread and never from inside announce() */
+	void announce(const AnnounceParams &announce, Handler handler);
+
+	/* Abandon the announce in flight, if any; its handler sees an error */
+	void cancel();
+
+	const std::string &get_url() const { return announce_url; }
+};
+
+/* One tracker of an announce-list tier, and what it has been told */
+struct TrackerEntry {
+	std::shared_ptr<TrackerConnection> connection;
+	std::string pending_event = "started"; /* cleared once this tracker has it */
+	bool in_flight = false;
+};
+
+/*
+ * Keeps the torrent's trackers up to date in the background, on a thread
+ * of its own, so nothing the caller does waits on a tracker. Announces
+ * carry the real transfer counters from TorrentState, and each tracker is
+ * sent "started" and "completed" until it accepts them.
+ *
+ * Trackers come in BEP 12 tiers. A round announces to every tracker of
+ * the first tier at once; the next tier joins in as soon as all of the
+ * current one have failed, or after TRACKER_FAILOVER_TIMEOUT seconds
+ * without an answer. The first tier to answer ends the search. Peers from
+ * every answer in the round are merged, and on_peers (called on the
+ * tracker thread) sees each address at most once per round. If no tracker
+ * answers, rounds back off from TRACKER_RETRY_MIN up to TRACKER_RETRY_MAX
+ * seconds, never sooner than the last min interval.
+ */
+class TrackerClient {
+public:
+	using PeersHandler = std::function<void(const std::vector<PeerInfo> &peers)>;
+
+private:
+	boost::asio::io_context io;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+	boost::asio::steady_timer timer;
+	boost::asio::steady_timer failover_timer;
+	std::vector<std::vector<std::shared_ptr<TrackerEntry>>> tiers;
+	TorrentState &state;
+	std::string info_hash;
+	std::string peer_id;
+	uint16_t port;
+	PeersHandler on_peers;
+	std::mt19937 rng;
+	std::thread worker;
+
+	bool round_active = false;
+	bool again = false; /* start another round as soon as this one is over */
+	bool stopping = false;
+	bool answered = false; /* some tracker answered this round */
+	size_t tiers_started = 0;
+	int outstanding = 0; /* announces in flight */
+	int failures = 0; /* rounds in a row that no tracker answered */
+	long long min_interval = 0;
+	std::chrono::steady_clock::time_point next_round;
+	std::unordered_set<std::string> round_peers; /* "ip:port" already handed to on_peers */
+
+	AnnounceParams make_params();
+	void announce_now();
+	void start_tier(size_t tier);
+	void handle_response(size_t tier, const std::shared_ptr<TrackerEntry> &entry, const std::string &event,
+						 const std::string &error, tracker_resp resp);
+	void end_round();
+	void schedule(std::chrono::steady_clock::time_point when);
+	void send_stopped();
+
+public:
+	/* Trackers with schemes other than http and udp are skipped; throws if none are left */
+	TrackerClient(const std::vector<std::vector<std::string>> &announce_tiers, TorrentState &state,
+				  const std::string &peer_id, uint16_t port, PeersHandler on_peers);
+	~TrackerClient();
+	TrackerClient(const TrackerClient&) = delete;
+	TrackerClient& operator=(const TrackerClient&) = delete;
+
+	/* Announce "started" and keep announcing until stop() */
+	void start();
+
+	/* The download just finished; tell the trackers now rather than at the next interval */
+	void completed();
+
+	/* Announce "stopped" to every tracker that has us, waiting at most TRACKER_STOP_TIMEOUT seconds */
+	void stop();
+};
+
+#endif /* tracker_client.hpp */
@@ -0,0 +1,61 @@
+#ifndef TRACKER_METRICS_HPP
+#define TRACKER_METRICS_HPP
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+class Tracker;
+
+/* Event counts; the announce counters are one per PeerEvent, in wire order */
+enum MetricCounter {
+	METRIC_HTTP_ANNOUNCES = 0,
+	METRIC_UDP_ANNOUNCES = METRIC_HTTP_ANNOUNCES + 4,
+	METRIC_HTTP_SCRAPES = METRIC_UDP_ANNOUNCES + 4,
+	METRIC_UDP_SCRAPES,
+	METRIC_SCRAPED_TORRENTS,
+	METRIC_UDP_CONNECTS,
+	METRIC_CONNECTIONS, /* TCP connections accepted */
+	METRIC_EXPIRED_PEERS,
+	METRIC_BAD_HTTP, /* unparseable, oversized or not a GET */
+	METRIC_BAD_ANNOUNCES,
+	METRIC_BAD_SCRAPES,
+	METRIC_BAD_UDP, /* stale connection id, short packet or unknown action */
+	METRIC_EXCEPTIONS,
+	NUM_METRIC_COUNTERS
+};
+
+/* Latencies are observed in nanoseconds, sizes in bytes */
+enum MetricHistogram {
+	METRIC_HTTP_ANNOUNCE_LATENCY,
+	METRIC_UDP_ANNOUNCE_LATENCY,
+	METRIC_HTTP_SCRAPE_LATENCY,
+	METRIC_UDP_SCRAPE_LATENCY,
+	METRIC_HTTP_ANNOUNCE_BYTES,
+	METRIC_UDP_ANNOUNCE_BYTES,
+	METRIC_HTTP_SCRAPE_BYTES,
+	METRIC_UDP_SCRAPE_BYTES,
+	NUM_METRIC_HISTOGRAMS
+};
+
+#define METRIC_MAX_BUCKETS 16 /* finite bucket bounds per histogram, +Inf is extra */
+
+/*
+ * Every thread that records anything gets its own block of counters,
+ * which only that thread writes (a relaxed load and store, no locked
+ * instruction, no shared cache line). /metrics sums all the blocks, so
+ * reading is the only place threads meet.
+ */
+void metric_count(MetricCounter counter, uint64_t n = 1);
+void metric_observe(MetricHistogram histogram, uint64_t value);
+
+inline uint64_t metric_elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+/* Prometheus text exposition of every counter and histogram plus the tracker's gauges */
+void append_metrics(const Tracker &tracker, std::string &out);
+
+#endif /* tracker_metrics.hpp */
@@ -0,0 +1,70 @@
+#ifndef TRACKER_STORE_HPP
+#define TRACKER_STORE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <tracker.hpp>
+
+#define STATE_FLUSH_INTERVAL 1 /* seconds between journal writes */
+#define STATE_SNAPSHOT_INTERVAL 60 /* seconds between snapshots */
+#define STATE_MAX_JOURNAL (256 << 20) /* journal bytes that force an early snapshot */
+#define STATE_FORMAT_VERSION 2
+
+/*
+ * Keeps the tracker's peer tables on disk so a restart comes back with
+ * full swarms instead of waiting an announce interval for every client.
+ *
+ * <dir>/snapshot holds every torrent as (info_hash, downloaded, peer
+ * count, raw PeerRecords), written to a temporary file and renamed into
+ * place. <dir>/journal gets every announce since that snapshot, appended
+ * once a second from the shards' in-memory queues. Both start with the
+ * same generation number, so a journal left behind by a crash between
+ * the two renames is recognised and ignored.
+ *
+ * Records are stored in native byte order, which is fine for restarting
+ * on the same machine and not meant as an exchange format. Journal
+ * writes are not fsynced: a process crash loses nothing that made it to
+ * write(), a power cut can lose the last few seconds.
+ */
+class TrackerStore {
+private:
+	std::string dir;
+	Tracker &tracker;
+	uint64_t generation = 0;
+	int journal_fd = -1;
+	size_t journal_bytes = 0;
+	std::vector<JournalEntry> pending; /* scratch for flush_journal() */
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	std::string path(const char *name) const { return dir + "/" + name; }
+	size_t load_snapshot();
+	size_t replay_journal();
+	void open_journal();
+	void flush_journal();
+	void write_snapshot();
+	void run();
+
+public:
+	/* Creates dir if needed */
+	TrackerStore(const std::string &dir, Tracker &tracker);
+	~TrackerStore();
+
+	/* Restore whatever was saved; call before the tracker serves anything */
+	void load();
+
+	/* Turn on journaling and start the background flush/snapshot thread */
+	void start();
+
+	/* Flush, take a last snapshot and stop the thread */
+	void stop();
+};
+
+#endif /* tracker_store.hpp */
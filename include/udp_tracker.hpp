@@ -0,0 +1,77 @@
+#ifndef UDP_TRACKER_HPP
+#define UDP_TRACKER_HPP
+
+#include <boost/asio.hpp>
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/* UDP tracker protocol (BEP 15), shared by the tracker and the client */
+#define UDP_PROTOCOL_ID 0x41727101980ULL
+#define UDP_MAX_PACKET 2048
+#define UDP_MAX_SCRAPE 74 /* info_hashes per scrape packet */
+#define UDP_CONNECTION_TTL 60 /* seconds a client may reuse a connection id */
+#define UDP_RECEIVES_PER_THREAD 4 /* datagrams the server keeps a receive posted for, per io thread */
+#define UDP_SOCKET_BUFFER (4 << 20) /* kernel queue for bursts, capped by net.core.rmem_max */
+
+class Tracker;
+
+enum UdpAction {
+	UDP_ACTION_CONNECT = 0,
+	UDP_ACTION_ANNOUNCE = 1,
+	UDP_ACTION_SCRAPE = 2,
+	UDP_ACTION_ERROR = 3
+};
+
+enum UdpEvent {
+	UDP_EVENT_NONE = 0,
+	UDP_EVENT_COMPLETED = 1,
+	UDP_EVENT_STARTED = 2,
+	UDP_EVENT_STOPPED = 3
+};
+
+/*
+ * Serves connect/announce/scrape datagrams on the tracker's port, over
+ * IPv4 and IPv6 from one dual-stack socket where the host has IPv6.
+ * Connection ids are not stored: each is a keyed hash of the client
+ * address and the current minute, so checking one is a hash and a
+ * compare, and a flood of connects costs no memory.
+ *
+ * Several receives stay posted at once, each with its own buffers, so
+ * datagrams are handled on all the io threads together. A receive is
+ * posted again only once its reply has gone out.
+ */
+class UdpTracker {
+private:
+	struct Receive {
+		std::array<char, UDP_MAX_PACKET> packet;
+		boost::asio::ip::udp::endpoint sender;
+		std::string reply;
+	};
+
+	boost::asio::ip::udp::socket socket;
+	bool dual_stack = false;
+	bool log_errors = false;
+	Tracker &tracker;
+	std::string secret;
+	std::vector<Receive> receives; /* sized once, handlers hold references */
+
+	uint64_t connection_id(const boost::asio::ip::udp::endpoint &ep, time_t window) const;
+	bool valid_connection_id(uint64_t id, const boost::asio::ip::udp::endpoint &ep) const;
+
+	void do_receive(Receive &r);
+	void send_reply(Receive &r);
+	void handle_packet(Receive &r, size_t len);
+	void handle_announce(Receive &r, size_t len);
+	void handle_scrape(Receive &r, size_t len);
+	void set_error(Receive &r, uint32_t transaction_id, const std::string &message);
+
+public:
+	UdpTracker(boost::asio::io_context &io, uint16_t port, Tracker &t, size_t in_flight);
+	/* Print packets that threw, as --log-errors asks; tracker_errors_total counts them either way */
+	void set_log_errors(bool on) { log_errors = on; }
+	void start();
+};
+
+#endif /* udp_tracker.hpp */
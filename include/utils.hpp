@@ -2,27 +2,20 @@
 #define UTILS_HPP
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <cstdint>
 #include <vector>
 
-struct HttpRequest {
-	std::string method;
-	std::string path;
-	std::string query;
-	std::string http_version;
-};
-
 struct URL {
+	std::string scheme = "http";
 	std::string host;
 	std::string port = "80";
 };
 
-std::string sha1_hash(const std::string& data);
+std::string sha1_hash(std::string_view data);
 std::string hash_to_hex(const std::string& hash);
 std::string url_encode(const std::string& str);
-std::string url_decode(const std::string& str);
-std::unordered_map<std::string, std::string> parse_query_params(const std::string& query);
 std::string generate_peer_id();
 std::string build_announce_request(const std::string& announce_url,
                                    const std::string& info_hash,
@@ -33,7 +26,7 @@ std::string build_announce_request(const std::string& announce_url,
                                    int64_t left,
                                    const std::string& event);
 URL parse_url(const std::string &url);
-HttpRequest parse_http_request_line(const std::string& request_line);
-std::string pack_bitfield(const std::vector<bool>& pieces);
-std::vector<bool> unpack_bitfield(const std::string& packed, size_t num_pieces);
+void append_bencode_int(std::string &out, long long value);
+void append_bencode_string_header(std::string &out, size_t length);
+void append_bencode_string(std::string &out, std::string_view str);
 #endif /* utils.hpp */
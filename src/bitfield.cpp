@@ -0,0 +1,93 @@
+#include <bitfield.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+Bitfield::Bitfield(size_t bits)
+	: words((bits + 63) / 64, 0), num_bits(bits) {}
+
+/*
+ * Bits past num_bits live in the low-order end of the last wire bytes.
+ * Keeping them zero means whole-word ANDs and popcounts never see garbage
+ * from a peer that sent junk in its padding.
+ */
+void Bitfield::clear_spare_bits()
+{
+	size_t used_bytes = wire_size();
+	if (num_bits % 8) {
+		bytes()[used_bytes - 1] &= static_cast<uint8_t>(0xff << (8 - num_bits % 8));
+	}
+	std::memset(bytes() + used_bytes, 0, words.size() * sizeof(uint64_t) - used_bytes);
+}
+
+bool Bitfield::test(size_t index) const
+{
+	if (index >= num_bits) return false;
+	return (bytes()[index / 8] & (0x80 >> (index % 8))) != 0;
+}
+
+void Bitfield::set(size_t index)
+{
+	if (index >= num_bits) return;
+	bytes()[index / 8] |= (0x80 >> (index % 8));
+}
+
+void Bitfield::reset(size_t index)
+{
+	if (index >= num_bits) return;
+	bytes()[index / 8] &= ~(0x80 >> (index % 8));
+}
+
+size_t Bitfield::count() const
+{
+	size_t total = 0;
+	for (uint64_t w : words) {
+		total += std::popcount(w);
+	}
+	return total;
+}
+
+void Bitfield::assign_wire(const char *data, size_t len)
+{
+	std::fill(words.begin(), words.end(), 0);
+	std::memcpy(bytes(), data, std::min(len, wire_size()));
+	clear_spare_bits();
+}
+
+std::string Bitfield::to_wire() const
+{
+	return std::string(reinterpret_cast<const char*>(bytes()), wire_size());
+}
+
+bool Bitfield::has_missing(const Bitfield &ours) const
+{
+	size_t n = std::min(words.size(), ours.words.size());
+	uint64_t acc = 0;
+	for (size_t i = 0; i < n; i++) {
+		acc |= words[i] & ~ours.words[i];
+	}
+	return acc != 0;
+}
+
+size_t Bitfield::count_missing(const Bitfield &ours) const
+{
+	size_t n = std::min(words.size(), ours.words.size());
+	size_t total = 0;
+	for (size_t i = 0; i < n; i++) {
+		total += std::popcount(words[i] & ~ours.words[i]);
+	}
+	return total;
+}
+
+size_t Bitfield::find_first_missing(const Bitfield &a, const Bitfield &b) const
+{
+	size_t n = std::min({words.size(), a.words.size(), b.words.size()});
+	for (size_t i = 0; i < n; i++) {
+		uint64_t w = words[i] & ~(a.words[i] | b.words[i]);
+		if (w == 0) continue;
+		/* Big-endian load puts byte 0, bit 7 (the lowest index) at the top */
+		return i * 64 + std::countl_zero(boost::endian::big_to_native(w));
+	}
+	return npos;
+}
@@ -0,0 +1,620 @@
+#include <cluster_front.hpp>
+#include <http_parser.hpp>
+#include <utils.hpp>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <cstring>
+
+using boost::asio::ip::tcp;
+
+/* Same limits as a tracker node's own sessions */
+#define FRONT_CLIENT_TIMEOUT 10
+#define FRONT_REQUEST_BUFFER_SIZE 8192
+
+/*
+ * One keep-alive connection to a node. Requests from any session are
+ * queued on the link's strand and written back to back; the node answers
+ * them in order, so responses are matched to the front of the queue.
+ * If the connection fails, requests get one more try on a new one.
+ */
+class NodeLink : public std::enable_shared_from_this<NodeLink> {
+public:
+	using Callback = std::function<void(bool ok, std::string_view body)>;
+
+private:
+	struct Pending {
+		std::string request;
+		Callback done;
+		int attempts;
+	};
+
+	boost::asio::strand<boost::asio::io_context::executor_type> strand;
+	tcp::socket socket;
+	tcp::endpoint endpoint;
+	boost::asio::steady_timer deadline;
+	std::deque<Pending> queue; /* unanswered, in send order */
+	size_t written = 0; /* how many at the front of queue are on the wire */
+	std::string write_buffer;
+	std::string read_buffer;
+	std::array<char, 16384> chunk;
+	bool connected = false, connecting = false, writing = false;
+	unsigned generation = 0; /* bumped on reset, so handlers of a dropped connection bail out */
+
+	void connect();
+	void flush();
+	void do_read();
+	void arm_deadline();
+	void reset(bool count_attempt);
+
+public:
+	NodeLink(boost::asio::io_context &io, const tcp::endpoint &ep);
+
+	/* Thread-safe; done runs on the link's strand */
+	void send(std::string request, Callback done);
+	void shutdown();
+};
+
+NodeLink::NodeLink(boost::asio::io_context &io, const tcp::endpoint &ep)
+	: strand(boost::asio::make_strand(io)), socket(strand), endpoint(ep), deadline(strand) {}
+
+void NodeLink::send(std::string request, Callback done)
+{
+	auto self = shared_from_this();
+	boost::asio::post(strand, [this, self, request = std::move(request), done = std::move(done)]() mutable {
+		if (queue.empty()) {
+			arm_deadline();
+		}
+		queue.push_back({std::move(request), std::move(done), 0});
+		if (connected) {
+			flush();
+		} else if (!connecting) {
+			connect();
+		}
+	});
+}
+
+void NodeLink::connect()
+{
+	connecting = true;
+	auto self = shared_from_this();
+	socket.async_connect(endpoint, [this, self, gen = generation](const boost::system::error_code &ec) {
+		if (gen != generation) {
+			return;
+		}
+		connecting = false;
+		if (ec) {
+			std::cerr << "cluster node " << endpoint << " unreachable: " << ec.message() << std::endl;
+			reset(true);
+			return;
+		}
+		boost::system::error_code ignored;
+		socket.set_option(tcp::no_delay(true), ignored);
+		connected = true;
+		flush();
+		do_read();
+	});
+}
+
+/* Everything queued since the last write goes out in one write */
+void NodeLink::flush()
+{
+	if (writing || written == queue.size()) {
+		return;
+	}
+	write_buffer.clear();
+	for (size_t i = written; i < queue.size(); i++) {
+		write_buffer += queue[i].request;
+		queue[i].attempts++;
+	}
+	written = queue.size();
+
+	writing = true;
+	auto self = shared_from_this();
+	boost::asio::async_write(socket, boost::asio::buffer(write_buffer),
+		[this, self, gen = generation](const boost::system::error_code &ec, size_t) {
+			if (gen != generation) {
+				return;
+			}
+			writing = false;
+			if (ec) {
+				reset(false);
+				return;
+			}
+			flush();
+		});
+}
+
+void NodeLink::do_read()
+{
+	auto self = shared_from_this();
+	socket.async_read_some(boost::asio::buffer(chunk),
+		[this, self, gen = generation](const boost::system::error_code &ec, size_t n) {
+			if (gen != generation) {
+				return;
+			}
+			if (ec) {
+				reset(false);
+				return;
+			}
+			read_buffer.append(chunk.data(), n);
+
+			size_t offset = 0;
+			while (!queue.empty() && written > 0) {
+				std::string_view body;
+				size_t consumed;
+				HttpParseResult result = parse_http_response(read_buffer.data() + offset,
+															 read_buffer.size() - offset, body, consumed);
+				if (result == HTTP_PARSE_INCOMPLETE) {
+					break;
+				}
+				if (result == HTTP_PARSE_ERROR) {
+					std::cerr << "cluster node " << endpoint << " sent a bad response" << std::endl;
+					reset(false);
+					return;
+				}
+				offset += consumed;
+				Pending done = std::move(queue.front());
+				queue.pop_front();
+				written--;
+				done.done(true, body);
+			}
+			read_buffer.erase(0, offset);
+
+			if (queue.empty()) {
+				deadline.cancel();
+			} else if (offset > 0) {
+				arm_deadline();
+			}
+			do_read();
+		});
+}
+
+void NodeLink::arm_deadline()
+{
+	auto self = shared_from_this();
+	deadline.expires_after(std::chrono::seconds(FRONT_NODE_TIMEOUT));
+	deadline.async_wait([this, self](const boost::system::error_code &ec) {
+		if (!ec) {
+			std::cerr << "cluster node " << endpoint << " timed out" << std::endl;
+			reset(true);
+		}
+	});
+}
+
+/*
+ * Drop the connection. Requests that have had their last try fail, the
+ * rest go out again on a fresh connection. A failed connect or a timeout
+ * counts as a try even for requests that were never written, so a dead
+ * node doesn't keep them waiting forever.
+ */
+void NodeLink::reset(bool count_attempt)
+{
+	boost::system::error_code ignored;
+	socket.close(ignored);
+	generation++;
+	connected = connecting = writing = false;
+	read_buffer.clear();
+
+	/* The first `written` were already counted when they were sent */
+	std::deque<Pending> retry;
+	for (size_t i = 0; i < queue.size(); i++) {
+		Pending &pending = queue[i];
+		if (count_attempt && i >= written) {
+			pending.attempts++;
+		}
+		if (pending.attempts >= FRONT_MAX_ATTEMPTS) {
+			pending.done(false, {});
+		} else {
+			retry.push_back(std::move(pending));
+		}
+	}
+	queue.swap(retry);
+	written = 0;
+
+	if (queue.empty()) {
+		deadline.cancel();
+	} else {
+		arm_deadline();
+		connect();
+	}
+}
+
+void NodeLink::shutdown()
+{
+	auto self = shared_from_this();
+	boost::asio::post(strand, [this, self]() {
+		boost::system::error_code ignored;
+		socket.close(ignored);
+		deadline.cancel();
+	});
+}
+
+/* Skip one bencoded value starting at pos; false if it is malformed */
+static bool skip_bencode(std::string_view s, size_t &pos)
+{
+	if (pos >= s.size()) {
+		return false;
+	}
+	char c = s[pos];
+	if (c == 'i') {
+		size_t end = s.find('e', pos);
+		if (end == std::string_view::npos) return false;
+		pos = end + 1;
+		return true;
+	}
+	if (c == 'l' || c == 'd') {
+		pos++;
+		while (pos < s.size() && s[pos] != 'e') {
+			if (!skip_bencode(s, pos)) return false;
+		}
+		if (pos >= s.size()) return false;
+		pos++;
+		return true;
+	}
+	size_t colon = s.find(':', pos);
+	if (colon == std::string_view::npos) return false;
+	size_t length = 0;
+	for (size_t i = pos; i < colon; i++) {
+		if (s[i] < '0' || s[i] > '9') return false;
+		length = length * 10 + (s[i] - '0');
+	}
+	if (s.size() - colon - 1 < length) return false;
+	pos = colon + 1 + length;
+	return true;
+}
+
+/*
+ * Merge the "files" dicts of several scrape responses into one, keeping
+ * the keys sorted as bencode requires.
+ */
+static bool merge_scrapes(const std::vector<std::string> &bodies, std::string &out)
+{
+	static const std::string_view prefix = "d5:filesd";
+	std::vector<std::pair<std::string_view, std::string_view>> entries;
+
+	for (const std::string &body : bodies) {
+		std::string_view s(body);
+		if (s.substr(0, prefix.size()) != prefix) {
+			return false;
+		}
+		size_t pos = prefix.size();
+		while (pos < s.size() && s[pos] != 'e') {
+			size_t key_start = pos;
+			if (!skip_bencode(s, pos)) return false;
+			size_t value_start = pos;
+			if (!skip_bencode(s, pos)) return false;
+
+			/* Keys are "20:<info_hash>"; compare on the hash bytes */
+			std::string_view key = s.substr(key_start, value_start - key_start);
+			key.remove_prefix(key.find(':') + 1);
+			entries.push_back({key, s.substr(value_start, pos - value_start)});
+		}
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+		int cmp = std::memcmp(a.first.data(), b.first.data(), std::min(a.first.size(), b.first.size()));
+		return cmp != 0 ? cmp < 0 : a.first.size() < b.first.size();
+	});
+
+	out += prefix;
+	for (const auto &[key, value] : entries) {
+		append_bencode_string(out, key);
+		out += value;
+	}
+	out += "ee";
+	return true;
+}
+
+/*
+ * A client connection to the front. Requests are handled one at a time
+ * in arrival order, so pipelined requests are answered in order even
+ * though they may go to different nodes; the answers collected while
+ * working through a read go out in one write.
+ */
+class FrontSession : public std::enable_shared_from_this<FrontSession> {
+private:
+	tcp::socket socket;
+	ClusterFront &front;
+	std::string client_ip;
+	std::array<char, FRONT_REQUEST_BUFFER_SIZE> buffer;
+	size_t buffered = 0;
+	size_t offset = 0; /* start of the next unhandled request in buffer */
+	boost::asio::steady_timer deadline;
+	std::string response;
+	bool keep_alive = true;
+	bool closing = false;
+
+	/* State of the scrape being fanned out */
+	std::vector<std::string> scrape_bodies;
+	size_t scrape_waiting = 0;
+
+	void arm_deadline();
+	void do_read();
+	void process_requests();
+	void forward_announce(const HttpRequest &request);
+	void forward_scrape(const HttpRequest &request);
+	void finish_request(bool ok, std::string_view body);
+	void do_write();
+	void close();
+
+public:
+	FrontSession(tcp::socket sock, ClusterFront &f);
+	void start();
+};
+
+FrontSession::FrontSession(tcp::socket sock, ClusterFront &f)
+	: socket(std::move(sock)), front(f), deadline(socket.get_executor()) {}
+
+void FrontSession::start()
+{
+	boost::system::error_code ec;
+	auto remote = socket.remote_endpoint(ec);
+	if (ec) {
+		close();
+		return;
+	}
+	client_ip = remote.address().to_string();
+	do_read();
+}
+
+void FrontSession::arm_deadline()
+{
+	auto self = shared_from_this();
+	deadline.expires_after(std::chrono::seconds(FRONT_CLIENT_TIMEOUT));
+	deadline.async_wait([this, self](const boost::system::error_code &ec) {
+		if (ec != boost::asio::error::operation_aborted) {
+			close();
+		}
+	});
+}
+
+void FrontSession::do_read()
+{
+	if (buffered == buffer.size()) {
+		std::cerr << "Bad request: header too large" << std::endl;
+		close();
+		return;
+	}
+
+	arm_deadline();
+	auto self = shared_from_this();
+	socket.async_read_some(boost::asio::buffer(buffer.data() + buffered, buffer.size() - buffered),
+		[this, self](const boost::system::error_code &ec, size_t n) {
+			deadline.cancel();
+			if (ec) {
+				close();
+				return;
+			}
+			buffered += n;
+			process_requests();
+		});
+}
+
+void FrontSession::process_requests()
+{
+	if (!closing) {
+		HttpRequest request;
+		size_t consumed;
+		HttpParseResult result = parse_http_request(buffer.data() + offset, buffered - offset,
+													request, consumed);
+		if (result == HTTP_PARSE_OK) {
+			offset += consumed;
+			keep_alive = request.keep_alive;
+			std::string_view path = request.path;
+			if (request.method != "GET") {
+				std::cerr << "Bad request: not GET" << std::endl;
+				closing = true;
+			} else if (path.size() >= 7 && path.substr(path.size() - 7) == "/scrape") {
+				forward_scrape(request);
+				return;
+			} else {
+				forward_announce(request);
+				return;
+			}
+		} else if (result == HTTP_PARSE_ERROR) {
+			std::cerr << "Bad request: malformed HTTP" << std::endl;
+			closing = true;
+		}
+	}
+
+	/* Keep any partial request at the front for the next read */
+	memmove(buffer.data(), buffer.data() + offset, buffered - offset);
+	buffered -= offset;
+	offset = 0;
+
+	if (!response.empty()) {
+		do_write();
+	} else if (closing) {
+		close();
+	} else {
+		do_read();
+	}
+}
+
+static std::string forwarded_request(const HttpRequest &request, std::string_view query,
+									 const std::string &client_ip)
+{
+	std::string out;
+	out.reserve(request.path.size() + query.size() + client_ip.size() + 48);
+	out += "GET ";
+	out += request.path;
+	out += '?';
+	out += query;
+	out += " HTTP/1.1\r\nX-Forwarded-For: ";
+	out += client_ip;
+	out += "\r\n\r\n";
+	return out;
+}
+
+void FrontSession::forward_announce(const HttpRequest &request)
+{
+	/* Checked here, since a node drops bad requests without an answer */
+	AnnounceRequest announce;
+	if (const char *error = parse_announce_query(request.query, announce)) {
+		std::cerr << "Bad announce request: " << error << "\n";
+		finish_request(false, {});
+		return;
+	}
+
+	auto self = shared_from_this();
+	front.link_for(front.owner(announce.info_hash)).send(
+		forwarded_request(request, request.query, client_ip),
+		[this, self](bool ok, std::string_view body) {
+			boost::asio::post(socket.get_executor(), [this, self, ok, body = std::string(body)]() {
+				finish_request(ok, body);
+			});
+		});
+}
+
+void FrontSession::forward_scrape(const HttpRequest &request)
+{
+	/* Sort the (still encoded) info_hash parameters into one query per node */
+	std::vector<std::string> queries(front.node_count());
+	std::string_view query = request.query, key, value;
+	while (next_query_param(query, key, value)) {
+		if (key != "info_hash") {
+			continue;
+		}
+		Id20 info_hash;
+		if (!url_decode_fixed(value, info_hash.data(), info_hash.size())) {
+			std::cerr << "Bad scrape request: Invalid info_hash\n";
+			finish_request(false, {});
+			return;
+		}
+		std::string &node_query = queries[front.owner(info_hash)];
+		node_query += node_query.empty() ? "info_hash=" : "&info_hash=";
+		node_query += value;
+	}
+
+	scrape_bodies.clear();
+	scrape_waiting = 0;
+	for (const std::string &node_query : queries) {
+		scrape_waiting += !node_query.empty();
+	}
+	if (scrape_waiting == 0) {
+		std::cerr << "Bad scrape request: Missing info_hash\n";
+		finish_request(false, {});
+		return;
+	}
+
+	auto self = shared_from_this();
+	for (size_t node = 0; node < queries.size(); node++) {
+		if (queries[node].empty()) {
+			continue;
+		}
+		front.link_for(node).send(forwarded_request(request, queries[node], client_ip),
+			[this, self](bool ok, std::string_view body) {
+				boost::asio::post(socket.get_executor(), [this, self, ok, body = std::string(body)]() {
+					if (!ok) {
+						closing = true;
+					} else {
+						scrape_bodies.push_back(body);
+					}
+					if (--scrape_waiting > 0) {
+						return;
+					}
+					if (closing) {
+						finish_request(false, {});
+						return;
+					}
+					std::string merged;
+					bool ok = merge_scrapes(scrape_bodies, merged);
+					finish_request(ok, merged);
+				});
+			});
+	}
+}
+
+/* Called on the session's strand once a request has its answer (or failed) */
+void FrontSession::finish_request(bool ok, std::string_view body)
+{
+	if (!ok) {
+		closing = true;
+	} else {
+		append_response(response, body, keep_alive);
+		if (!keep_alive) {
+			closing = true;
+		}
+	}
+	process_requests();
+}
+
+void FrontSession::do_write()
+{
+	auto self = shared_from_this();
+	boost::asio::async_write(socket, boost::asio::buffer(response),
+		[this, self](const boost::system::error_code &ec, size_t) {
+			response.clear();
+			if (ec || closing) {
+				close();
+				return;
+			}
+			do_read();
+		});
+}
+
+void FrontSession::close()
+{
+	boost::system::error_code ignored;
+	deadline.cancel();
+	socket.shutdown(tcp::socket::shutdown_both, ignored);
+	socket.close(ignored);
+}
+
+ClusterFront::ClusterFront(boost::asio::io_context &io, uint16_t port, const std::vector<std::string> &nodes)
+	: acceptor(io, tcp::endpoint(tcp::v4(), port)), ring(nodes)
+{
+	tcp::resolver resolver(io);
+	for (const std::string &node : nodes) {
+		size_t colon = node.rfind(':');
+		if (colon == std::string::npos) {
+			throw std::runtime_error("cluster node must be host:port: " + node);
+		}
+		tcp::endpoint endpoint = *resolver.resolve(node.substr(0, colon), node.substr(colon + 1)).begin();
+
+		links.emplace_back();
+		for (int i = 0; i < FRONT_LINKS_PER_NODE; i++) {
+			links.back().push_back(std::make_shared<NodeLink>(io, endpoint));
+		}
+	}
+}
+
+ClusterFront::~ClusterFront()
+{
+	for (auto &node_links : links) {
+		for (auto &link : node_links) {
+			link->shutdown();
+		}
+	}
+}
+
+void ClusterFront::start()
+{
+	do_accept();
+}
+
+NodeLink &ClusterFront::link_for(size_t node)
+{
+	std::vector<std::shared_ptr<NodeLink>> &node_links = links[node];
+	return *node_links[next_link.fetch_add(1, std::memory_order_relaxed) % node_links.size()];
+}
+
+void ClusterFront::do_accept()
+{
+	acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()),
+		[this](const boost::system::error_code &ec, tcp::socket socket) {
+			if (!ec) {
+				boost::system::error_code ignored;
+				socket.set_option(tcp::no_delay(true), ignored);
+				std::make_shared<FrontSession>(std::move(socket), *this)->start();
+			} else if (ec == boost::asio::error::operation_aborted) {
+				return;
+			} else {
+				std::cerr << "accept error: " << ec.message() << std::endl;
+			}
+			do_accept();
+		});
+}
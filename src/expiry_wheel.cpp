@@ -0,0 +1,14 @@
+#include <expiry_wheel.hpp>
+
+ExpiryWheel::ExpiryWheel(int span, time_t now)
+	: slots(span), current(now) {}
+
+time_t ExpiryWheel::schedule(time_t deadline, const Id20 &info_hash, const Id20 &peer_id)
+{
+	/* Anything already due goes in the next slot to be processed */
+	if (deadline <= current) {
+		deadline = current + 1;
+	}
+	slots[deadline % slots.size()].push_back({static_cast<uint32_t>(deadline), info_hash, peer_id});
+	return deadline;
+}
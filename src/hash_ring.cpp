@@ -0,0 +1,34 @@
+#include <hash_ring.hpp>
+#include <utils.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+HashRing::HashRing(const std::vector<std::string> &nodes)
+{
+	if (nodes.empty()) {
+		throw std::invalid_argument("hash ring needs at least one node");
+	}
+
+	for (size_t node = 0; node < nodes.size(); node++) {
+		for (int i = 0; i < RING_POINTS_PER_NODE; i++) {
+			std::string digest = sha1_hash(nodes[node] + "#" + std::to_string(i));
+			uint64_t position = boost::endian::load_big_u64(
+				reinterpret_cast<const unsigned char*>(digest.data()));
+			points.push_back({position, node});
+		}
+	}
+	std::sort(points.begin(), points.end());
+}
+
+/* info_hashes are SHA-1 digests, so their leading bytes are already a uniform ring position */
+size_t HashRing::owner(const Id20 &info_hash) const
+{
+	uint64_t position = boost::endian::load_big_u64(
+		reinterpret_cast<const unsigned char*>(info_hash.data()));
+	auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(position, size_t(0)));
+	if (it == points.end()) {
+		it = points.begin();
+	}
+	return it->second;
+}
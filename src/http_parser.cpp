@@ -0,0 +1,237 @@
+#include <http_parser.hpp>
+#include <charconv>
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		char x = a[i], y = b[i];
+		if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+		if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+		if (x != y) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static std::string_view trim(std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+	return s;
+}
+
+HttpParseResult parse_http_request(const char *data, size_t len, HttpRequest &req, size_t &consumed)
+{
+	std::string_view buf(data, len);
+	size_t head_end = buf.find("\r\n\r\n");
+	if (head_end == std::string_view::npos) {
+		return HTTP_PARSE_INCOMPLETE;
+	}
+	consumed = head_end + 4;
+
+	/* Request line: METHOD SP target SP HTTP/1.x */
+	size_t line_end = buf.find("\r\n");
+	std::string_view line = buf.substr(0, line_end);
+	size_t sp1 = line.find(' ');
+	size_t sp2 = line.rfind(' ');
+	if (sp1 == std::string_view::npos || sp2 == sp1) {
+		return HTTP_PARSE_ERROR;
+	}
+	req.method = line.substr(0, sp1);
+	std::string_view target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+	std::string_view version = line.substr(sp2 + 1);
+
+	if (version == "HTTP/1.1") {
+		req.keep_alive = true;
+	} else if (version == "HTTP/1.0") {
+		req.keep_alive = false;
+	} else {
+		return HTTP_PARSE_ERROR;
+	}
+
+	size_t qmark = target.find('?');
+	req.path = target.substr(0, qmark);
+	req.query = qmark == std::string_view::npos ? std::string_view() : target.substr(qmark + 1);
+
+	/* Only the Connection header matters to us */
+	size_t pos = line_end + 2;
+	while (pos < head_end) {
+		size_t next = buf.find("\r\n", pos);
+		std::string_view header = buf.substr(pos, next - pos);
+		pos = next + 2;
+
+		size_t colon = header.find(':');
+		if (colon == std::string_view::npos) {
+			return HTTP_PARSE_ERROR;
+		}
+		std::string_view name = trim(header.substr(0, colon));
+		std::string_view value = trim(header.substr(colon + 1));
+		if (iequals(name, "Connection")) {
+			if (iequals(value, "close")) {
+				req.keep_alive = false;
+			} else if (iequals(value, "keep-alive")) {
+				req.keep_alive = true;
+			}
+		} else if (iequals(name, "X-Forwarded-For")) {
+			req.forwarded_for = trim(value.substr(0, value.find(',')));
+		}
+	}
+
+	return HTTP_PARSE_OK;
+}
+
+HttpParseResult parse_http_response(const char *data, size_t len, std::string_view &body, size_t &consumed)
+{
+	std::string_view buf(data, len);
+	size_t head_end = buf.find("\r\n\r\n");
+	if (head_end == std::string_view::npos) {
+		return HTTP_PARSE_INCOMPLETE;
+	}
+
+	/* Status line: HTTP/1.x SP 200 SP reason */
+	size_t line_end = buf.find("\r\n");
+	std::string_view line = buf.substr(0, line_end);
+	size_t sp = line.find(' ');
+	if (sp == std::string_view::npos || line.substr(sp + 1, 3) != "200") {
+		return HTTP_PARSE_ERROR;
+	}
+
+	size_t length = 0;
+	bool have_length = false;
+	size_t pos = line_end + 2;
+	while (pos < head_end) {
+		size_t next = buf.find("\r\n", pos);
+		std::string_view header = buf.substr(pos, next - pos);
+		pos = next + 2;
+
+		size_t colon = header.find(':');
+		if (colon != std::string_view::npos && iequals(trim(header.substr(0, colon)), "Content-Length")) {
+			std::string_view value = trim(header.substr(colon + 1));
+			auto res = std::from_chars(value.data(), value.data() + value.size(), length);
+			have_length = res.ec == std::errc() && res.ptr == value.data() + value.size();
+		}
+	}
+	if (!have_length) {
+		return HTTP_PARSE_ERROR;
+	}
+	if (len - (head_end + 4) < length) {
+		return HTTP_PARSE_INCOMPLETE;
+	}
+
+	body = buf.substr(head_end + 4, length);
+	consumed = head_end + 4 + length;
+	return HTTP_PARSE_OK;
+}
+
+void append_response(std::string &out, std::string_view body, bool keep_alive)
+{
+	char length[24];
+	auto res = std::to_chars(length, length + sizeof(length), body.size());
+
+	out += "HTTP/1.1 200 OK\r\n";
+	out += "Content-Type: text/plain\r\n";
+	out += "Content-Length: ";
+	out.append(length, res.ptr);
+	out += keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+	out += body;
+}
+
+bool next_query_param(std::string_view &query, std::string_view &key, std::string_view &value)
+{
+	while (!query.empty()) {
+		size_t amp = query.find('&');
+		std::string_view pair = query.substr(0, amp);
+		query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+
+		size_t eq = pair.find('=');
+		if (eq == std::string_view::npos) {
+			continue;
+		}
+		key = pair.substr(0, eq);
+		value = pair.substr(eq + 1);
+		return true;
+	}
+	return false;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+bool url_decode_fixed(std::string_view in, char *out, size_t out_len)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < in.size(); i++) {
+		if (n == out_len) {
+			return false;
+		}
+		char c = in[i];
+		if (c == '%') {
+			if (i + 2 >= in.size()) {
+				return false;
+			}
+			int hi = hex_value(in[i + 1]), lo = hex_value(in[i + 2]);
+			if (hi < 0 || lo < 0) {
+				return false;
+			}
+			c = static_cast<char>(hi << 4 | lo);
+			i += 2;
+		} else if (c == '+') {
+			c = ' ';
+		}
+		out[n++] = c;
+	}
+	return n == out_len;
+}
+
+template <typename T>
+static bool parse_number(std::string_view s, T &out)
+{
+	auto res = std::from_chars(s.data(), s.data() + s.size(), out);
+	return res.ec == std::errc() && res.ptr == s.data() + s.size();
+}
+
+const char *parse_announce_query(std::string_view query, AnnounceRequest &req)
+{
+	bool have_info_hash = false, have_peer_id = false, have_port = false;
+	std::string_view key, value;
+
+	while (next_query_param(query, key, value)) {
+		if (key == "info_hash") {
+			if (!url_decode_fixed(value, req.info_hash.data(), req.info_hash.size())) return "Invalid info_hash";
+			have_info_hash = true;
+		} else if (key == "peer_id") {
+			if (!url_decode_fixed(value, req.peer_id.data(), req.peer_id.size())) return "Invalid peer_id";
+			have_peer_id = true;
+		} else if (key == "port") {
+			if (!parse_number(value, req.port)) return "Invalid port";
+			have_port = true;
+		} else if (key == "uploaded") {
+			if (!parse_number(value, req.uploaded)) return "Invalid uploaded";
+		} else if (key == "downloaded") {
+			if (!parse_number(value, req.downloaded)) return "Invalid downloaded";
+		} else if (key == "left") {
+			if (!parse_number(value, req.left)) return "Invalid left";
+			req.has_left = true;
+		} else if (key == "event") {
+			req.event = value;
+		} else if (key == "compact") {
+			req.compact = value == "1";
+		} else if (key == "numwant") {
+			if (!parse_number(value, req.numwant)) return "Invalid numwant";
+		}
+	}
+
+	if (!have_info_hash) return "Invalid info_hash";
+	if (!have_peer_id) return "Invalid peer_id";
+	if (!have_port) return "Missing port";
+	return nullptr;
+}
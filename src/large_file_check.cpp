@@ -0,0 +1,143 @@
+#include <torrent_metadata.hpp>
+#include <torrent_state.hpp>
+#include <utils.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define CHECK_PIECE_LENGTH (4LL << 20)
+#define CHECK_FILE_LENGTH ((3LL << 40) - 12345) /* 3 TiB, with a short last piece */
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		cerr << "FAILED line " << __LINE__ << ": " #cond << endl; \
+		failures++; \
+	} \
+} while (0)
+
+/* Fill byte of each piece the check writes; the others are never touched */
+static string piece_data(int index, int64_t size)
+{
+	return string(size, static_cast<char>('A' + index % 26));
+}
+
+/*
+ * A single-file torrent whose hashes are right for the pieces in written
+ * and zero for the rest, which stay holes in the sparse payload.
+ */
+static void write_torrent(const string &path, const map<int, int64_t> &written, int num_pieces)
+{
+	string pieces(static_cast<size_t>(num_pieces) * 20, '\0');
+	for (const auto &[index, size] : written) {
+		pieces.replace(static_cast<size_t>(index) * 20, 20, sha1_hash(piece_data(index, size)));
+	}
+
+	ofstream out(path, ios::binary);
+	out << "d8:announce30:http://127.0.0.1:8080/announce4:infod"
+		<< "6:lengthi" << CHECK_FILE_LENGTH << "e"
+		<< "4:name11:payload.bin"
+		<< "12:piece lengthi" << CHECK_PIECE_LENGTH << "e"
+		<< "6:pieces" << pieces.size() << ":" << pieces
+		<< "ee";
+	if (!out) {
+		throw runtime_error("unable to write " + path);
+	}
+}
+
+/* What is really at offset in the file, read past TorrentState */
+static string raw_read(const string &path, int64_t offset, size_t len)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw runtime_error("unable to open " + path + ": " + strerror(errno));
+	}
+	string data(len, '\0');
+	ssize_t n = pread(fd, &data[0], len, offset);
+	close(fd);
+	data.resize(n < 0 ? 0 : n);
+	return data;
+}
+
+/*
+ * Checks the 64-bit size and offset paths on a sparse multi-TB payload:
+ * bytes_left(), piece offsets past 2 and 4 GiB and at the end of the
+ * file, and pieces written there landing at exactly that offset.
+ */
+int main(int argc, char *argv[])
+{
+	string base = argc > 1 ? argv[1] : "/tmp";
+	string dir_template = base + "/large_file_check.XXXXXX";
+	if (!mkdtemp(&dir_template[0])) {
+		cerr << "unable to create a directory in " << base << ": " << strerror(errno) << endl;
+		return 1;
+	}
+	string dir = dir_template;
+	string torrent_path = dir + "/payload.bin.torrent";
+	string payload_path = dir + "/payload.bin";
+
+	const int num_pieces = static_cast<int>((CHECK_FILE_LENGTH - 1) / CHECK_PIECE_LENGTH + 1);
+	const int last = num_pieces - 1;
+	const int64_t last_size = CHECK_FILE_LENGTH - static_cast<int64_t>(last) * CHECK_PIECE_LENGTH;
+	/* First pieces at 2 GiB and 4 GiB, where 32-bit offsets go negative or wrap */
+	const int past_2g = static_cast<int>((1LL << 31) / CHECK_PIECE_LENGTH);
+	const int past_4g = static_cast<int>((1LL << 32) / CHECK_PIECE_LENGTH);
+	map<int, int64_t> written = {
+		{past_2g, CHECK_PIECE_LENGTH}, {past_4g, CHECK_PIECE_LENGTH}, {last, last_size}};
+
+	try {
+		write_torrent(torrent_path, written, num_pieces);
+		auto meta = make_shared<const TorrentMetadata>(torrent_path);
+		CHECK(meta->file_length == CHECK_FILE_LENGTH);
+		CHECK(meta->num_pieces == num_pieces);
+		CHECK(meta->piece_offset(past_2g) == 1LL << 31);
+		CHECK(meta->piece_offset(past_4g) == 1LL << 32);
+		CHECK(meta->piece_offset(last) == CHECK_FILE_LENGTH - last_size);
+		CHECK(meta->piece_size(last) == last_size);
+
+		TorrentState state(meta, payload_path, STORAGE_SPARSE);
+		struct stat st;
+		CHECK(stat(payload_path.c_str(), &st) == 0 && st.st_size == CHECK_FILE_LENGTH);
+		CHECK(state.bytes_left() == CHECK_FILE_LENGTH);
+		CHECK(state.get_piece_size(last) == last_size);
+
+		int64_t left = CHECK_FILE_LENGTH;
+		for (const auto &[index, size] : written) {
+			string data = piece_data(index, size);
+			CHECK(state.verify_piece(index, data));
+			state.write_piece(index, data);
+			state.set_complete(index);
+			left -= size;
+			CHECK(state.bytes_left() == left);
+			CHECK(state.read_piece(index) == data);
+			CHECK(raw_read(payload_path, meta->piece_offset(index), data.size()) == data);
+		}
+		CHECK(!state.is_file_complete());
+	} catch (const exception &e) {
+		cerr << "Error: " << e.what() << endl;
+		failures++;
+	}
+
+	unlink(payload_path.c_str());
+	unlink(torrent_path.c_str());
+	rmdir(dir.c_str());
+
+	if (failures > 0) {
+		cout << failures << " check(s) failed" << endl;
+		return 1;
+	}
+	cout << "large file checks passed (" << num_pieces << " pieces, " << CHECK_FILE_LENGTH
+		 << " bytes)" << endl;
+	return 0;
+}
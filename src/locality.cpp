@@ -0,0 +1,117 @@
+#include <locality.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+Id20 Locality::subnet_key(const std::array<uint8_t, 16> &addr, bool ipv6, int length)
+{
+	Id20 key{};
+	key[0] = ipv6;
+	key[1] = static_cast<char>(length);
+	int full = length / 8;
+	std::copy(addr.begin(), addr.begin() + full, key.begin() + 2);
+	if (length % 8) {
+		key[2 + full] = static_cast<char>(addr[full] & (0xff << (8 - length % 8)));
+	}
+	return key;
+}
+
+void Locality::set_prefixes(int v4, int v6)
+{
+	if (v4 < 0 || v4 > 32 || v6 < 0 || v6 > 128) {
+		throw std::runtime_error("locality prefix out of range (0-32 for IPv4, 0-128 for IPv6)");
+	}
+	prefix4 = v4;
+	prefix6 = v6;
+}
+
+void Locality::load_zone_map(const std::string &path)
+{
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error("unable to open zone map " + path);
+	}
+
+	std::unordered_map<std::string, uint32_t> zone_ids;
+	std::string line;
+	for (int line_no = 1; std::getline(in, line); line_no++) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		std::string subnet, zone, extra;
+		if (!(fields >> subnet)) {
+			continue;
+		}
+		auto bad_line = [&](const std::string &why) {
+			return std::runtime_error(path + ":" + std::to_string(line_no) + ": " + why);
+		};
+		if (!(fields >> zone) || (fields >> extra)) {
+			throw bad_line("expected \"<subnet> <zone>\"");
+		}
+
+		size_t slash = subnet.find('/');
+		boost::system::error_code ec;
+		auto ip = boost::asio::ip::make_address(subnet.substr(0, slash), ec);
+		if (ec) {
+			throw bad_line("bad address " + subnet.substr(0, slash));
+		}
+		int max_length = ip.is_v4() ? 32 : 128;
+		int length = max_length;
+		if (slash != std::string::npos) {
+			length = atoi(subnet.c_str() + slash + 1);
+			if (length < 0 || length > max_length) {
+				throw bad_line("bad prefix length in " + subnet);
+			}
+		}
+
+		PeerRecord record;
+		record.set_address(ip);
+		auto [id, added] = zone_ids.try_emplace(zone, static_cast<uint32_t>(zone_ids.size() + 1));
+		*subnets.insert(subnet_key(record.addr, record.ipv6(), length)).first = id->second;
+
+		std::vector<int> &lengths = record.ipv6() ? lengths6 : lengths4;
+		if (std::find(lengths.begin(), lengths.end(), length) == lengths.end()) {
+			lengths.push_back(length);
+		}
+	}
+	std::sort(lengths4.rbegin(), lengths4.rend());
+	std::sort(lengths6.rbegin(), lengths6.rend());
+	num_zones = zone_ids.size();
+}
+
+/* Leading length bits of the address, the rest zeroed */
+static uint64_t masked(const uint8_t *bytes, int length)
+{
+	uint64_t word = boost::endian::load_big_u64(bytes);
+	return length <= 0 ? 0 : length >= 64 ? word : word & ~(~0ULL >> length);
+}
+
+/*
+ * Mapped zones are small ids; per-prefix zones are the masked prefix
+ * itself (IPv4) or a mix of it (IPv6) with the top bit set, so the two
+ * never collide.
+ */
+uint64_t Locality::zone_of(const PeerRecord &peer) const
+{
+	bool ipv6 = peer.ipv6();
+	if (!subnets.empty()) {
+		for (int length : ipv6 ? lengths6 : lengths4) {
+			if (const uint32_t *zone = subnets.find(subnet_key(peer.addr, ipv6, length))) {
+				return *zone;
+			}
+		}
+	}
+
+	if (!ipv6) {
+		return prefix4 == 0 ? 0 : (masked(peer.addr.data(), prefix4) >> 32) | (1ULL << 63);
+	}
+	if (prefix6 == 0) {
+		return 0;
+	}
+	uint64_t high = masked(peer.addr.data(), prefix6);
+	uint64_t low = masked(peer.addr.data() + 8, prefix6 - 64);
+	return ((high * 0x9e3779b97f4a7c15ULL) ^ low) | (1ULL << 63);
+}
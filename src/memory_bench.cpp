@@ -0,0 +1,93 @@
+#include <tracker.hpp>
+#include <peer_record.hpp>
+#include <boost/asio/ip/address_v4.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <malloc.h>
+
+using namespace std;
+
+struct MemoryOptions {
+	size_t peers = 1000000;
+	size_t torrents = 10000;
+};
+
+static Id20 make_id(const char *prefix, size_t n)
+{
+	Id20 id;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s%0*zu", prefix, static_cast<int>(id.size() - strlen(prefix)), n);
+	memcpy(id.data(), buf, id.size());
+	return id;
+}
+
+/* Bytes malloc has handed out and not had back, mmapped blocks included; one thread, so one arena */
+static size_t heap_in_use()
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+static PeerRecord make_peer(size_t n)
+{
+	PeerRecord peer;
+	peer.peer_id = make_id("-MB0001-", n);
+	peer.set_address(boost::asio::ip::address_v4(static_cast<uint32_t>(0x0a000000 + n)));
+	peer.port = 6881 + n % 1000;
+	peer.flags |= n % 2 ? PEER_SEED : 0;
+	return peer;
+}
+
+/*
+ * Heap the tracker holds per peer: peers spread evenly over the
+ * torrents, each announced once (compact, numwant 0, so responses cost
+ * nothing), measured against the empty tracker. A second figure follows
+ * one sampled dict announce per torrent, after which those swarms keep
+ * a pre-encoded dict fragment for every peer.
+ */
+int main(int argc, char *argv[])
+{
+	MemoryOptions opts;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--peers" && has_value) {
+			opts.peers = max(1L, atol(argv[++i]));
+		} else if (arg == "--torrents" && has_value) {
+			opts.torrents = max(1L, atol(argv[++i]));
+		} else {
+			cout << "usage: " << argv[0] << " [--peers <n>] [--torrents <n>]" << endl;
+			return 1;
+		}
+	}
+
+	Tracker tracker;
+	size_t empty = heap_in_use();
+
+	string out;
+	for (size_t n = 0; n < opts.peers; n++) {
+		PeerRecord peer = make_peer(n);
+		peer.event = EVENT_STARTED;
+		out.clear();
+		tracker.handle_announce(make_id("-MB-TORRENT-", n % opts.torrents), peer, true, 0, out);
+	}
+	size_t loaded = heap_in_use();
+	TrackerTotals totals = tracker.totals();
+
+	for (size_t t = 0; t < min(opts.torrents, opts.peers); t++) {
+		out.clear();
+		tracker.handle_announce(make_id("-MB-TORRENT-", t), make_peer(t), false, DEFAULT_NUMWANT, out);
+	}
+	size_t with_dicts = heap_in_use();
+
+	printf("%zu peers in %zu torrents, %zu-byte records\n", totals.peers, totals.torrents, sizeof(PeerRecord));
+	printf("compact only:          %8.1f MB  %6.1f bytes/peer\n", (loaded - empty) / 1e6,
+		   static_cast<double>(loaded - empty) / totals.peers);
+	printf("after dict responses:  %8.1f MB  %6.1f bytes/peer\n", (with_dicts - empty) / 1e6,
+		   static_cast<double>(with_dicts - empty) / totals.peers);
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <torrent_metadata.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define BENCH_PIECE_LENGTH (256 << 10)
+
+/* Resident set size and its peak so far, in KiB, from /proc/self/status */
+static void memory_kb(long &rss, long &peak)
+{
+	rss = peak = 0;
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line)) {
+		if (line.rfind("VmRSS:", 0) == 0) {
+			rss = atol(line.c_str() + 6);
+		} else if (line.rfind("VmHWM:", 0) == 0) {
+			peak = atol(line.c_str() + 6);
+		}
+	}
+}
+
+/* Streamed out a chunk at a time, so writing it doesn't raise the peak measured afterwards */
+static void write_torrent(const string &path, long pieces)
+{
+	ofstream out(path, ios::binary);
+	out << "d8:announce30:http://127.0.0.1:8080/announce4:infod"
+		<< "6:lengthi" << static_cast<int64_t>(pieces) * BENCH_PIECE_LENGTH << "e"
+		<< "4:name11:payload.bin"
+		<< "12:piece lengthi" << BENCH_PIECE_LENGTH << "e"
+		<< "6:pieces" << pieces * 20 << ":";
+
+	mt19937_64 rng(1);
+	vector<uint64_t> chunk(5 * 4096); /* 4096 digests */
+	for (long done = 0; done < pieces; done += 4096) {
+		long n = min(4096L, pieces - done);
+		generate(chunk.begin(), chunk.end(), ref(rng));
+		out.write(reinterpret_cast<const char*>(chunk.data()), n * 20);
+	}
+	out << "ee";
+	if (!out) {
+		throw runtime_error("unable to write " + path);
+	}
+}
+
+/*
+ * Load time and memory of parsing a torrent with a very large "pieces"
+ * string: the figure that matters is the peak RSS over what the process
+ * used before, since a copying parser pays the whole blob at least once.
+ */
+int main(int argc, char *argv[])
+{
+	long pieces = 1200000;
+	int runs = 5;
+	string dir = "/tmp";
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--pieces" && has_value) {
+			pieces = max(1L, atol(argv[++i]));
+		} else if (arg == "--runs" && has_value) {
+			runs = max(1, atoi(argv[++i]));
+		} else if (arg == "--dir" && has_value) {
+			dir = argv[++i];
+		} else {
+			cout << "usage: " << argv[0] << " [--pieces <n>] [--runs <n>] [--dir <dir>]" << endl;
+			return 1;
+		}
+	}
+
+	string path = dir + "/metadata_bench." + to_string(getpid()) + ".torrent";
+	try {
+		write_torrent(path, pieces);
+
+		long rss_before, peak_before;
+		memory_kb(rss_before, peak_before);
+
+		vector<double> times;
+		for (int run = 0; run < runs; run++) {
+			auto start = Clock::now();
+			TorrentMetadata meta(path);
+			times.push_back(chrono::duration<double, milli>(Clock::now() - start).count());
+			if (meta.num_pieces != pieces) {
+				throw runtime_error("parsed " + to_string(meta.num_pieces) + " pieces");
+			}
+		}
+		sort(times.begin(), times.end());
+
+		long rss_after, peak_after;
+		memory_kb(rss_after, peak_after);
+
+		printf("%ld pieces (%.1f MB torrent), %d loads\n", pieces, pieces * 20 / 1e6, runs);
+		printf("load ms: min %.2f  median %.2f  max %.2f\n", times.front(), times[times.size() / 2], times.back());
+		printf("RSS KiB: %ld before loading, peak %ld (+%ld)\n", rss_before, peak_after, peak_after - rss_before);
+	} catch (const exception &e) {
+		cerr << "Error: " << e.what() << endl;
+		unlink(path.c_str());
+		return 1;
+	}
+	unlink(path.c_str());
+	return 0;
+}
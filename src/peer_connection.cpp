@@ -1,6 +1,7 @@
 #include <peer_connection.hpp>
 #include <boost/asio.hpp>
 #include <boost/endian/conversion.hpp>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <cstring>
@@ -10,23 +11,30 @@
 #define HANDSHAKE_SIZE 68
 #define PROTOCOL_VERSION 19
 #define BTSPTP_PROTOCOL "BitTorrent protocol"
+#define PEER_MAX_QUEUED (16 << 20) /* bytes waiting to be sent before we stop reading requests */
 PeerConnection::PeerConnection(boost::asio::io_context& io,
         					   const PeerInfo& peer,
 							   TorrentState& state,
 							   const std::string& our_id,
 							   const std::string& hash)
-	: socket(io),
+	: io(io),
+	  socket(io),
 	  peer_info(peer),
 	  torrent_state(state),
+	  closed(false),
+	  queued_bytes(0),
+	  writing(false),
+	  read_length_be(0),
+	  read_paused(false),
 	  our_peer_id(our_id),
 	  info_hash(hash),
+	  peer_bitfield(state.get_total_pieces()),
 	  am_choking(true),
 	  am_interested(false),
 	  peer_choking(true),
 	  peer_interested(false),
 	  current_piece_index(-1)
 {
-	peer_bitfield.resize(torrent_state.get_total_pieces(), false);
 }
 
 std::vector<uint8_t> PeerConnection::build_handshake()
@@ -61,56 +69,111 @@ void PeerConnection::validate_handshake(const std::vector<uint8_t> &response)
     if (their_info_hash != info_hash) {
         throw std::runtime_error("Info hash mismatch - different torrent");
     }
-}
 
-void PeerConnection::connect() {
-    try {
-        boost::asio::ip::tcp::endpoint endpoint(
-            boost::asio::ip::make_address(peer_info.ip),
-            peer_info.port
-        );
+    peer_info.peer_id.assign(response.begin() + 48, response.end());
+}
 
-        socket.connect(endpoint);
+void PeerConnection::connect(std::chrono::seconds timeout) {
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::make_address(peer_info.ip),
+        peer_info.port
+    );
+
+    boost::system::error_code ec;
+    socket.async_connect(endpoint, [&](const boost::system::error_code& result) {
+        ec = result;
+    });
+    complete_within(timeout, ec);
+
+    if (ec) {
+        std::cerr << "Failed to connect to " << peer_info.ip << ":"
+                  << peer_info.port << " - " << ec.message() << std::endl;
+        throw boost::system::system_error(ec);
+    }
 
-        std::cout << "Connected to peer " << peer_info.ip << ":" 
-                  << peer_info.port << std::endl;
+    std::cout << "Connected to peer " << peer_info.ip << ":"
+              << peer_info.port << std::endl;
+}
 
-    } catch (const boost::system::system_error& e) {
-        std::cerr << "Failed to connect to " << peer_info.ip << ":" 
-                  << peer_info.port << " - " << e.what() << std::endl;
-        throw;
+/*
+ * Run io until the operations just started on it finish. Past timeout
+ * the socket is closed, which aborts them, and ec says timed_out; after
+ * close() it says operation_aborted whatever the operations reported.
+ */
+void PeerConnection::complete_within(std::chrono::seconds timeout, boost::system::error_code& ec)
+{
+    io.restart();
+    io.run_for(timeout);
+    if (!io.stopped()) {
+        boost::system::error_code ignored;
+        socket.close(ignored);
+        io.restart();
+        io.run(); /* let the aborted handlers run before their captures go out of scope */
+        ec = boost::asio::error::timed_out;
+    }
+    if (closed) {
+        ec = boost::asio::error::operation_aborted;
     }
 }
 
-void PeerConnection::send_handshake()
+void PeerConnection::close() {
+    boost::asio::post(io, [this]() {
+        closed = true;
+        boost::system::error_code ignored;
+        socket.close(ignored);
+    });
+}
+
+void PeerConnection::send_handshake(std::chrono::seconds timeout)
 {
 	auto handshake = build_handshake();
-    boost::asio::write(socket, boost::asio::buffer(handshake));
-    std::cout << "Sent handshake to peer" << std::endl;
-
     std::vector<uint8_t> response(HANDSHAKE_SIZE);
-    boost::asio::read(socket, boost::asio::buffer(response));
+    boost::system::error_code write_ec, read_ec, ec;
+    boost::asio::async_write(socket, boost::asio::buffer(handshake),
+        [&](const boost::system::error_code& result, size_t) { write_ec = result; });
+    boost::asio::async_read(socket, boost::asio::buffer(response),
+        [&](const boost::system::error_code& result, size_t) { read_ec = result; });
+    complete_within(timeout, ec);
+    if (!ec) {
+        ec = write_ec ? write_ec : read_ec;
+    }
+    if (ec) {
+        throw boost::system::system_error(ec, "handshake");
+    }
+    std::cout << "Sent handshake to peer" << std::endl;
     std::cout << "Received handshake from peer" << std::endl;
 	validate_handshake(response);
     std::cout << "Handshake successful with peer" << std::endl;
 }
 
-void PeerConnection::receive_handshake()
+void PeerConnection::receive_handshake(std::chrono::seconds timeout)
 {
     std::vector<uint8_t> response(HANDSHAKE_SIZE);
-    boost::asio::read(socket, boost::asio::buffer(response));
+    boost::system::error_code ec;
+    boost::asio::async_read(socket, boost::asio::buffer(response),
+        [&](const boost::system::error_code& result, size_t) { ec = result; });
+    complete_within(timeout, ec);
+    if (ec) {
+        throw boost::system::system_error(ec, "handshake");
+    }
 	validate_handshake(response);
     std::cout << "Received handshake from peer" << std::endl;
 	std::vector<uint8_t> handshake = build_handshake();
 
-    boost::asio::write(socket, boost::asio::buffer(handshake));
+    boost::asio::async_write(socket, boost::asio::buffer(handshake),
+        [&](const boost::system::error_code& result, size_t) { ec = result; });
+    complete_within(timeout, ec);
+    if (ec) {
+        throw boost::system::system_error(ec, "handshake");
+    }
     std::cout << "Sent handshake to peer" << std::endl;
     std::cout << "Handshake successful with peer" << std::endl;
 }
 
-void PeerConnection::start_with_socket(boost::asio::ip::tcp::socket sock)
+void PeerConnection::start_with_socket(const boost::asio::ip::tcp& protocol,
+                                       boost::asio::ip::tcp::socket::native_handle_type fd)
 {
-    socket = std::move(sock);
+    socket.assign(protocol, fd);
     std::cout << "Accepted connection from peer" << std::endl;
 }
 
@@ -156,16 +219,43 @@ void PeerConnection::send_message(uint8_t msg_id, const std::string& payload)
 
 	uint32_t lenbe = boost::endian::native_to_big(len); /* Big endian so fun... :( */
 
-	std::vector<uint8_t> message;
+	std::string message;
 	message.reserve(sizeof(len) + len);
+	message.append(reinterpret_cast<char*>(&lenbe), sizeof(lenbe));
+	message.push_back(static_cast<char>(msg_id));
+	message.append(payload);
+
+	queued_bytes += message.size();
+	send_queue.push_back(std::move(message));
+	if (!writing) {
+		write_next();
+	}
+}
 
-	uint8_t *lenbe_bytes = reinterpret_cast<uint8_t*>(&lenbe);
-	message.insert(message.end(), lenbe_bytes, lenbe_bytes + sizeof(lenbe));
-
-	message.push_back(msg_id);
-	message.insert(message.end(), payload.begin(), payload.end());
-
-	boost::asio::write(socket, boost::asio::buffer(message));
+/* One async_write in flight at a time, so queued messages go out whole and in order */
+void PeerConnection::write_next()
+{
+	if (send_queue.empty()) {
+		writing = false;
+		return;
+	}
+	writing = true;
+	boost::asio::async_write(socket, boost::asio::buffer(send_queue.front()),
+		[this](const boost::system::error_code& ec, size_t) {
+			if (closed) {
+				return;
+			}
+			if (ec) {
+				throw boost::system::system_error(ec);
+			}
+			queued_bytes -= send_queue.front().size();
+			send_queue.pop_front();
+			if (read_paused && queued_bytes <= PEER_MAX_QUEUED) {
+				read_paused = false;
+				read_message();
+			}
+			write_next();
+		});
 }
 
 void PeerConnection::handle_choke()
@@ -200,7 +290,7 @@ void PeerConnection::handle_have(const std::string& payload)
 	std::memcpy(&index_be, payload.data(), sizeof(uint32_t));
 	uint32_t piece_index = boost::endian::big_to_native(index_be); /* Big endian so fun... :( */
 	if (piece_index < peer_bitfield.size()) {
-		peer_bitfield[piece_index] = true;
+		peer_bitfield.set(piece_index);
 		if (!torrent_state.have_piece(piece_index) && !am_interested) {
 			send_interested();
 		}
@@ -209,14 +299,18 @@ void PeerConnection::handle_have(const std::string& payload)
 
 void PeerConnection::handle_bitfield(const std::string& payload)
 {
-	std::vector<bool> potential_bitfield = unpack_bitfield(payload, peer_bitfield.size());
-	peer_bitfield = potential_bitfield;
+	/* BEP 3: a bitfield of the wrong length drops the connection */
+	if (payload.size() != peer_bitfield.wire_size()) {
+		throw std::runtime_error("BITFIELD payload is " + std::to_string(payload.size()) +
+								 " bytes, expected " + std::to_string(peer_bitfield.wire_size()));
+	}
+	peer_bitfield.assign_wire(payload.data(), payload.size());
 
-	for (size_t i = 0; i < peer_bitfield.size(); i++) {
-		if (peer_bitfield[i] && !torrent_state.have_piece(i)) {
-			send_interested();
-			break;
-		}
+	std::cout << "Peer has " << peer_bitfield.count() << " / "
+			  << peer_bitfield.size() << " pieces" << std::endl;
+
+	if (torrent_state.is_interesting(peer_bitfield)) {
+		send_interested();
 	}
 }
 
@@ -236,9 +330,11 @@ void PeerConnection::handle_request(const std::string& payload)
 	uint32_t begin = boost::endian::big_to_native(begin_be);
 	uint32_t length = boost::endian::big_to_native(length_be);
 
-	if (am_choking || !torrent_state.have_piece(index)) return;
+	if (am_choking || index >= static_cast<uint32_t>(torrent_state.get_total_pieces()) ||
+		!torrent_state.have_piece(index)) return;
 	std::string full_piece = torrent_state.read_piece(index);
-	if (begin + length > full_piece.size()) {
+	/* Widen before adding so a hostile begin + length can't wrap around */
+	if (static_cast<uint64_t>(begin) + length > full_piece.size()) {
 		std::cerr << "Request out of bounds" << std::endl;
 		return;
 	}
@@ -262,6 +358,7 @@ void PeerConnection::handle_piece(const std::string& payload)
 	uint32_t begin = boost::endian::big_to_native(begin_be);
 
     std::string block_data = payload.substr(sizeof(uint32_t) * 2);
+    torrent_state.add_downloaded(block_data.size());
 
     std::cout << "Received piece " << index
               << " offset " << begin
@@ -277,6 +374,11 @@ void PeerConnection::handle_piece(const std::string& payload)
         return;
     }
 
+    if (index >= static_cast<uint32_t>(torrent_state.get_total_pieces())) {
+        std::cerr << "Piece index " << index << " out of range" << std::endl;
+        return;
+    }
+
     if (!torrent_state.verify_piece(index, block_data)) {
         std::cerr << "Piece " << index << " failed verification!" << std::endl;
 		/* Could re-request */
@@ -319,15 +421,13 @@ void PeerConnection::send_not_interested()
 }
 void PeerConnection::send_bitfield()
 {
-	std::vector<bool> our_bitfield = torrent_state.get_bitfield();
-	std::string packed = pack_bitfield(our_bitfield);
-	send_message(MSG_BITFIELD, packed);
+	send_message(MSG_BITFIELD, torrent_state.get_wire_bitfield());
 }
-void PeerConnection::send_request(int index, int begin, int length)
+void PeerConnection::send_request(int index, uint32_t begin, uint32_t length)
 {
 	uint32_t index_be = boost::endian::native_to_big(static_cast<uint32_t>(index));
-    uint32_t begin_be = boost::endian::native_to_big(static_cast<uint32_t>(begin));
-    uint32_t length_be = boost::endian::native_to_big(static_cast<uint32_t>(length));
+    uint32_t begin_be = boost::endian::native_to_big(begin);
+    uint32_t length_be = boost::endian::native_to_big(length);
 
     std::string payload;
     payload.append(reinterpret_cast<char*>(&index_be), sizeof(index_be));
@@ -337,10 +437,10 @@ void PeerConnection::send_request(int index, int begin, int length)
     send_message(MSG_REQUEST, payload);
 }
 
-void PeerConnection::send_piece(int index, int begin, const std::string& data)
+void PeerConnection::send_piece(int index, uint32_t begin, const std::string& data)
 {
 	uint32_t index_be = boost::endian::native_to_big(static_cast<uint32_t>(index));
-    uint32_t begin_be = boost::endian::native_to_big(static_cast<uint32_t>(begin));
+    uint32_t begin_be = boost::endian::native_to_big(begin);
 
     std::string payload;
     payload.append(reinterpret_cast<char*>(&index_be), sizeof(index_be));
@@ -348,6 +448,7 @@ void PeerConnection::send_piece(int index, int begin, const std::string& data)
     payload.append(data);
 
     send_message(MSG_PIECE, payload);
+    torrent_state.add_uploaded(data.size());
 }
 
 void PeerConnection::send_have(int index)
@@ -358,15 +459,6 @@ void PeerConnection::send_have(int index)
     send_message(MSG_HAVE, payload);
 }
 
-bool PeerConnection::peer_has_piece(int index) const
-{
-	if (index < 0 || index >= static_cast<int>(peer_bitfield.size())) {
-		return false;
-	}
-
-	return peer_bitfield[index];
-}
-
 void PeerConnection::download_next_piece() {
     if (peer_choking || current_piece_index != -1) {
         return;
@@ -377,68 +469,113 @@ void PeerConnection::download_next_piece() {
         return;
     }
 
-    int piece_index = torrent_state.get_next_piece_to_download();
+    int piece_index = torrent_state.get_next_piece_to_download(peer_bitfield);
 
     if (piece_index == -1) {
         return;
     }
 
-    if (!peer_has_piece(piece_index)) {
+    int64_t piece_length = torrent_state.get_piece_size(piece_index);
+    if (piece_length > UINT32_MAX) {
+        std::cerr << "Piece " << piece_index << " too large for a single request" << std::endl;
         return;
     }
 
     torrent_state.set_in_progress(piece_index);
     current_piece_index = piece_index;
 
-    size_t piece_length = torrent_state.get_piece_length();
-    if (piece_index == static_cast<int>(torrent_state.get_total_pieces() - 1)) {
-        size_t total_size = torrent_state.get_metadata().file_length;
-        size_t last_piece_size = total_size - (piece_index * piece_length);
-        piece_length = last_piece_size;
-    }
-
     std::cout << "Requesting piece " << piece_index 
               << " length " << piece_length << std::endl;
     send_request(piece_index, 0, piece_length);
 }
 
-void PeerConnection::run() {
-    try {
-        /* After handshake, exchange bitfields */
-        send_bitfield();
-
-        while (true) {
-            if (torrent_state.is_file_complete()) {
-                std::cout << "File complete, continuing to seed..." << std::endl;
-                /* break here if you don't want to seed */
-			}
-            uint32_t length_be;
-            boost::asio::read(socket, boost::asio::buffer(&length_be, sizeof(uint32_t)));
-            uint32_t length = boost::endian::big_to_native(length_be);
+/*
+ * Reads one message, handles it and reads the next. While more than
+ * PEER_MAX_QUEUED is waiting to be sent the next read waits for the
+ * writes, so a peer that requests without reading can't grow the queue.
+ */
+void PeerConnection::read_message()
+{
+    if (queued_bytes > PEER_MAX_QUEUED) {
+        read_paused = true;
+        return;
+    }
+    if (torrent_state.is_file_complete()) {
+        std::cout << "File complete, continuing to seed..." << std::endl;
+        /* close here if you don't want to seed */
+    }
+    boost::asio::async_read(socket, boost::asio::buffer(&read_length_be, sizeof(uint32_t)),
+        [this](const boost::system::error_code& ec, size_t) {
+            if (closed) {
+                return;
+            }
+            if (ec) {
+                throw boost::system::system_error(ec);
+            }
+            uint32_t length = boost::endian::big_to_native(read_length_be);
 
             /* Handle keep-alive (length = 0) */
             if (length == 0) {
                 std::cout << "Received keep-alive" << std::endl;
-                continue;
+                read_message();
+                return;
             }
 
-            uint8_t msg_id;
-            boost::asio::read(socket, boost::asio::buffer(&msg_id, 1));
-
-            std::string payload;
-            if (length > 1) {
-                payload.resize(length - 1);
-                boost::asio::read(socket, boost::asio::buffer(&payload[0], length - 1));
+            /*
+             * Nothing valid is longer than a whole piece (we only request
+             * full pieces) or a bitfield, so don't let a header alone make
+             * us allocate up to 4 GiB.
+             */
+            int64_t longest = std::max<int64_t>(torrent_state.get_piece_length() + 9,
+                                                static_cast<int64_t>(peer_bitfield.wire_size()) + 1);
+            if (length > longest) {
+                throw std::runtime_error("message of " + std::to_string(length) +
+                                         " bytes, longest valid is " + std::to_string(longest));
             }
 
-            handle_message(msg_id, payload);
-        }
+            /* Message ID and payload together */
+            read_buffer.resize(length);
+            boost::asio::async_read(socket, boost::asio::buffer(&read_buffer[0], length),
+                [this](const boost::system::error_code& ec, size_t) {
+                    if (closed) {
+                        return;
+                    }
+                    if (ec) {
+                        throw boost::system::system_error(ec);
+                    }
+                    uint8_t msg_id = static_cast<uint8_t>(read_buffer[0]);
+                    handle_message(msg_id, read_buffer.substr(1));
+                    read_message();
+                });
+        });
+}
+
+void PeerConnection::run() {
+    try {
+        /* After handshake, exchange bitfields */
+        send_bitfield();
+        read_message();
+
+        /* Returns once the peer goes away (a handler throws) or close() aborts the reads */
+        io.restart();
+        io.run();
 
     } catch (const boost::system::system_error& e) {
         std::cerr << "Connection error with peer: " << e.what() << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Error in peer connection: " << e.what() << std::endl;
     }
+
+    /* Abort whatever is still pending; with closed set its handlers just return */
+    closed = true;
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    io.restart();
+    io.run();
+
+    /* Another peer can fetch the piece we were waiting on */
+    if (current_piece_index != -1) {
+        torrent_state.clear_in_progress(current_piece_index);
+    }
     std::cout << "Peer connection ended" << std::endl;
 }
-
@@ -0,0 +1,278 @@
+#include <peer_manager.hpp>
+#include <peer_connection.hpp>
+#include <algorithm>
+#include <iostream>
+
+PeerManager::PeerManager(TorrentState &torrent_state, const std::string &our_id, const std::string &hash)
+	: state(torrent_state),
+	  our_peer_id(our_id),
+	  info_hash(hash),
+	  rng(std::random_device{}())
+{
+}
+
+PeerManager::~PeerManager()
+{
+	stop();
+}
+
+void PeerManager::start()
+{
+	dialer = std::thread(&PeerManager::run_dialer, this);
+}
+
+void PeerManager::stop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (stopping) {
+		return;
+	}
+	stopping = true;
+	for (PeerConnection *conn : live) {
+		conn->close();
+	}
+	changed.notify_all();
+
+	lock.unlock();
+	if (dialer.joinable()) {
+		dialer.join();
+	}
+	lock.lock();
+
+	/*
+	 * The closes run on each connection's own thread and end it promptly.
+	 * Threads not tracked yet see stopping in track() and end too. Only
+	 * once all are gone is nothing left that could touch this object.
+	 */
+	changed.wait(lock, [this]() {
+		return threads == 0;
+	});
+}
+
+void PeerManager::add_candidates(const std::vector<PeerInfo> &peers)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t added = 0;
+	for (const PeerInfo &peer : peers) {
+		if (candidates.size() >= PEER_MAX_CANDIDATES) {
+			break;
+		}
+		if (candidates.try_emplace(peer.ip + ":" + std::to_string(peer.port), peer).second) {
+			added++;
+		}
+	}
+	if (added > 0) {
+		changed.notify_all();
+	}
+}
+
+size_t PeerManager::active_count()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return connections.size();
+}
+
+/* Call with mutex held */
+std::chrono::steady_clock::time_point PeerManager::retry_time(int failures)
+{
+	long long wait = std::min<long long>(static_cast<long long>(PEER_RETRY_MIN) << std::min(failures - 1, 20),
+										 PEER_RETRY_MAX);
+	wait = std::uniform_int_distribution<long long>(wait * 3 / 4, wait * 5 / 4)(rng);
+	return std::chrono::steady_clock::now() + std::chrono::seconds(wait);
+}
+
+void PeerManager::run_dialer()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		auto now = std::chrono::steady_clock::now();
+		auto wake = now + std::chrono::seconds(PEER_RETRY_MIN);
+		bool downloading = !state.is_file_complete();
+
+		while (downloading && connections.size() + dialing < PEER_TARGET_ACTIVE && dialing < PEER_MAX_DIALING) {
+			std::string best_key;
+			PeerCandidate *best = nullptr;
+			for (auto &[key, candidate] : candidates) {
+				if (candidate.dialing || candidate.connected ||
+					(!candidate.peer_id.empty() && connections.count(candidate.peer_id))) {
+					continue;
+				}
+				if (candidate.next_attempt > now) {
+					wake = std::min(wake, candidate.next_attempt);
+					continue;
+				}
+				if (!best || candidate.failures < best->failures) {
+					best_key = key;
+					best = &candidate;
+				}
+			}
+			if (!best) {
+				break;
+			}
+			best->dialing = true;
+			dialing++;
+			threads++;
+			std::thread([this, key = best_key, peer = best->info]() {
+				dial(key, peer);
+				thread_finished();
+			}).detach();
+		}
+
+		changed.wait_until(lock, wake);
+	}
+}
+
+void PeerManager::dial(std::string key, PeerInfo peer)
+{
+	boost::asio::io_context io;
+	PeerConnection conn(io, peer, state, our_peer_id, info_hash);
+
+	bool registered = false;
+	try {
+		if (track(conn)) {
+			std::cout << "connecting to peer: " << peer.ip << ":" << peer.port << std::endl;
+			conn.connect(std::chrono::seconds(PEER_CONNECT_TIMEOUT));
+			conn.send_handshake(std::chrono::seconds(PEER_HANDSHAKE_TIMEOUT));
+			registered = register_connection(conn);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "peer error (" << peer.ip << ":" << peer.port << "): " << e.what() << std::endl;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		dialing--;
+		auto it = candidates.find(key);
+		if (it != candidates.end()) {
+			PeerCandidate &candidate = it->second;
+			candidate.dialing = false;
+			candidate.peer_id = conn.remote_peer_id();
+			if (registered) {
+				candidate.connected = true;
+				candidate.failures = 0;
+			} else if (candidate.peer_id == our_peer_id) {
+				candidates.erase(it);
+			} else if (!candidate.peer_id.empty()) {
+				/* Reached, but already connected; skipped while that connection lasts */
+				candidate.next_attempt = retry_time(1);
+			} else if (++candidate.failures >= PEER_MAX_FAILURES) {
+				candidates.erase(it);
+			} else {
+				candidate.next_attempt = retry_time(candidate.failures);
+			}
+		}
+		changed.notify_all();
+	}
+
+	if (registered) {
+		conn.run();
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = candidates.find(key);
+		if (it != candidates.end()) {
+			it->second.connected = false;
+			it->second.next_attempt = retry_time(++it->second.failures);
+		}
+	}
+	connection_ended(conn, registered);
+}
+
+void PeerManager::accept(boost::asio::ip::tcp::socket sock)
+{
+	boost::system::error_code ec;
+	boost::asio::ip::tcp protocol = sock.local_endpoint(ec).protocol();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (stopping || connections.size() + dialing + incoming >= PEER_MAX_ACTIVE) {
+		std::cout << "turning away incoming connection: at " << PEER_MAX_ACTIVE << " peers" << std::endl;
+		return;
+	}
+	/* The connection's thread runs an io_context of its own, so it takes the bare descriptor */
+	boost::asio::ip::tcp::socket::native_handle_type fd = sock.release(ec);
+	if (ec) {
+		std::cerr << "incoming peer error: " << ec.message() << std::endl;
+		return;
+	}
+	incoming++;
+	threads++;
+	std::thread([this, protocol, fd]() {
+		serve_incoming(protocol, fd);
+		thread_finished();
+	}).detach();
+}
+
+void PeerManager::serve_incoming(boost::asio::ip::tcp protocol, boost::asio::ip::tcp::socket::native_handle_type fd)
+{
+	boost::asio::io_context io;
+	PeerConnection conn(io, PeerInfo("", "", 0), state, our_peer_id, info_hash);
+
+	bool registered = false;
+	try {
+		conn.start_with_socket(protocol, fd);
+		if (track(conn)) {
+			conn.receive_handshake(std::chrono::seconds(PEER_HANDSHAKE_TIMEOUT));
+			registered = register_connection(conn);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "incoming peer error: " << e.what() << std::endl;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		incoming--;
+	}
+	if (registered) {
+		conn.run();
+	}
+	connection_ended(conn, registered);
+}
+
+/* Into live, where stop() can close it; false once stopping, when it must not start */
+bool PeerManager::track(PeerConnection &conn)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (stopping) {
+		return false;
+	}
+	live.insert(&conn);
+	return true;
+}
+
+/*
+ * The last thing each connection thread does, after its connection and
+ * io_context are gone: stop() may return, and this object with it, as
+ * soon as the mutex is released.
+ */
+void PeerManager::thread_finished()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	threads--;
+	changed.notify_all();
+}
+
+/* After the handshake: false if this peer is us, or is already connected */
+bool PeerManager::register_connection(PeerConnection &conn)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::string &id = conn.remote_peer_id();
+	if (stopping) {
+		return false;
+	}
+	if (id == our_peer_id) {
+		std::cout << "dropping connection to ourselves" << std::endl;
+		return false;
+	}
+	if (!connections.emplace(id, &conn).second) {
+		std::cout << "already connected to peer " << id << ", dropping duplicate" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void PeerManager::connection_ended(PeerConnection &conn, bool registered)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (registered) {
+		connections.erase(conn.remote_peer_id());
+	}
+	live.erase(&conn);
+	changed.notify_all();
+}
@@ -0,0 +1,55 @@
+#include <peer_record.hpp>
+#include <utils.hpp>
+#include <algorithm>
+
+PeerEvent parse_event(std::string_view event)
+{
+	if (event == "started") return EVENT_STARTED;
+	if (event == "completed") return EVENT_COMPLETED;
+	if (event == "stopped") return EVENT_STOPPED;
+	return EVENT_NONE;
+}
+
+void PeerRecord::set_address(const boost::asio::ip::address &ip)
+{
+	addr.fill(0);
+	if (ip.is_v4()) {
+		auto bytes = ip.to_v4().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), addr.begin());
+		flags &= ~PEER_IPV6;
+	} else {
+		auto bytes = ip.to_v6().to_bytes();
+		std::copy(bytes.begin(), bytes.end(), addr.begin());
+		flags |= PEER_IPV6;
+	}
+}
+
+std::string PeerRecord::ip_string() const
+{
+	if (ipv6()) {
+		boost::asio::ip::address_v6::bytes_type bytes;
+		std::copy(addr.begin(), addr.end(), bytes.begin());
+		return boost::asio::ip::address_v6(bytes).to_string();
+	}
+	boost::asio::ip::address_v4::bytes_type bytes;
+	std::copy(addr.begin(), addr.begin() + 4, bytes.begin());
+	return boost::asio::ip::address_v4(bytes).to_string();
+}
+
+void PeerRecord::append_compact(std::string &out) const
+{
+	out.append(reinterpret_cast<const char*>(addr.data()), ipv6() ? 16 : 4);
+	out.push_back(static_cast<char>(port >> 8));
+	out.push_back(static_cast<char>(port & 0xff));
+}
+
+void PeerRecord::append_dict(std::string &out) const
+{
+	out += "d2:ip";
+	append_bencode_string(out, ip_string());
+	out += "7:peer id";
+	append_bencode_string(out, std::string_view(peer_id.data(), peer_id.size()));
+	out += "4:port";
+	append_bencode_int(out, port);
+	out += 'e';
+}
@@ -0,0 +1,110 @@
+#include <tracker.hpp>
+#include <peer_record.hpp>
+#include <boost/asio/ip/address_v4.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct ResponseOptions {
+	vector<size_t> swarm_sizes = {50000, 40};
+	int numwant = DEFAULT_NUMWANT;
+	double duration = 2;
+};
+
+static Id20 make_id(const char *prefix, size_t n)
+{
+	Id20 id;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s%0*zu", prefix, static_cast<int>(id.size() - strlen(prefix)), n);
+	memcpy(id.data(), buf, id.size());
+	return id;
+}
+
+static PeerRecord make_peer(size_t n)
+{
+	PeerRecord peer;
+	peer.peer_id = make_id("-RB0001-", n);
+	peer.set_address(boost::asio::ip::address_v4(static_cast<uint32_t>(0x0a000000 + n)));
+	peer.port = 6881 + n % 1000;
+	peer.flags |= n % 2 ? PEER_SEED : 0;
+	return peer;
+}
+
+/*
+ * Announces per second for one swarm, on one thread: every announce is a
+ * regular one from a random member, and its whole response body is built
+ * into a buffer reused across announces, as the server does.
+ */
+static void run_case(const ResponseOptions &opts, size_t swarm_size, bool compact)
+{
+	Tracker tracker;
+	Id20 info_hash = make_id("-RB-TORRENT-", 0);
+	vector<PeerRecord> peers;
+	string out;
+	for (size_t n = 0; n < swarm_size; n++) {
+		peers.push_back(make_peer(n));
+		PeerRecord started = peers.back();
+		started.event = EVENT_STARTED;
+		out.clear();
+		tracker.handle_announce(info_hash, started, compact, opts.numwant, out);
+	}
+
+	mt19937 rng(1);
+	uniform_int_distribution<size_t> pick(0, swarm_size - 1);
+	size_t announces = 0;
+	size_t bytes = 0;
+	auto start = Clock::now();
+	auto stop = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(opts.duration));
+	while (Clock::now() < stop) {
+		for (int i = 0; i < 1000; i++) {
+			out.clear();
+			tracker.handle_announce(info_hash, peers[pick(rng)], compact, opts.numwant, out);
+			bytes += out.size();
+		}
+		announces += 1000;
+	}
+	double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+	printf("%6zu peers  %-7s  %10.0f responses/s  %6zu bytes each\n", swarm_size,
+		   compact ? "compact" : "dict", announces / seconds, bytes / announces);
+}
+
+int main(int argc, char *argv[])
+{
+	ResponseOptions opts;
+	bool sizes_given = false;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--peers" && has_value) {
+			if (!sizes_given) {
+				opts.swarm_sizes.clear();
+				sizes_given = true;
+			}
+			opts.swarm_sizes.push_back(max(1L, atol(argv[++i])));
+		} else if (arg == "--numwant" && has_value) {
+			opts.numwant = atoi(argv[++i]);
+		} else if (arg == "--duration" && has_value) {
+			opts.duration = max(0.1, atof(argv[++i]));
+		} else {
+			cout << "usage: " << argv[0] << " [--peers <swarm_size>]... [--numwant <n>] [--duration <secs>]" << endl;
+			return 1;
+		}
+	}
+
+	printf("numwant %d, %.1f s per case, 1 thread\n", opts.numwant, opts.duration);
+	for (size_t swarm_size : opts.swarm_sizes) {
+		run_case(opts, swarm_size, false);
+		run_case(opts, swarm_size, true);
+	}
+	return 0;
+}
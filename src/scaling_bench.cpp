@@ -0,0 +1,144 @@
+#include <tracker.hpp>
+#include <peer_record.hpp>
+#include <boost/asio/ip/address_v4.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct ScalingOptions {
+	int max_threads = 32;
+	vector<int> shard_counts = {1, TRACKER_SHARDS};
+	size_t torrents = 1000;
+	size_t peers = 50; /* per torrent */
+	double duration = 2;
+};
+
+static Id20 make_id(const char *prefix, size_t n)
+{
+	Id20 id;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s%0*zu", prefix, static_cast<int>(id.size() - strlen(prefix)), n);
+	memcpy(id.data(), buf, id.size());
+	return id;
+}
+
+/*
+ * Announces per second from threads hammering one Tracker, spread
+ * uniformly over the torrents, each from one of that torrent's peers.
+ * With one shard every announce takes the same lock; with more, two
+ * threads only wait on each other when they hit the same shard.
+ */
+static double run_point(const ScalingOptions &opts, int shards, int threads)
+{
+	Tracker tracker(ANNOUNCE_INTERVAL, PEER_TIMEOUT, shards);
+	vector<Id20> info_hashes;
+	for (size_t t = 0; t < opts.torrents; t++) {
+		info_hashes.push_back(make_id("-SB-TORRENT-", t));
+	}
+	auto peer_for = [&opts](size_t torrent, size_t n) {
+		PeerRecord peer;
+		size_t id = torrent * opts.peers + n;
+		peer.peer_id = make_id("-SB0001-", id);
+		peer.set_address(boost::asio::ip::address_v4(static_cast<uint32_t>(0x0a000000 + id)));
+		peer.port = 6881;
+		peer.flags |= n % 2 ? PEER_SEED : 0;
+		return peer;
+	};
+
+	string out;
+	for (size_t t = 0; t < opts.torrents; t++) {
+		for (size_t n = 0; n < opts.peers; n++) {
+			PeerRecord peer = peer_for(t, n);
+			peer.event = EVENT_STARTED;
+			out.clear();
+			tracker.handle_announce(info_hashes[t], peer, true, DEFAULT_NUMWANT, out);
+		}
+	}
+
+	atomic<bool> stop{false};
+	atomic<uint64_t> total{0};
+	vector<thread> workers;
+	for (int k = 0; k < threads; k++) {
+		workers.emplace_back([&, k]() {
+			mt19937 rng(k + 1);
+			uniform_int_distribution<size_t> pick_torrent(0, opts.torrents - 1);
+			uniform_int_distribution<size_t> pick_peer(0, opts.peers - 1);
+			string body;
+			uint64_t announces = 0;
+			while (!stop.load(memory_order_relaxed)) {
+				for (int i = 0; i < 256; i++) {
+					size_t t = pick_torrent(rng);
+					body.clear();
+					tracker.handle_announce(info_hashes[t], peer_for(t, pick_peer(rng)), true,
+											DEFAULT_NUMWANT, body);
+				}
+				announces += 256;
+			}
+			total += announces;
+		});
+	}
+
+	auto start = chrono::steady_clock::now();
+	this_thread::sleep_for(chrono::duration<double>(opts.duration));
+	stop = true;
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	return total / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	ScalingOptions opts;
+	bool shards_given = false;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--threads" && has_value) {
+			opts.max_threads = max(1, atoi(argv[++i]));
+		} else if (arg == "--shards" && has_value) {
+			if (!shards_given) {
+				opts.shard_counts.clear();
+				shards_given = true;
+			}
+			opts.shard_counts.push_back(max(1, atoi(argv[++i])));
+		} else if (arg == "--torrents" && has_value) {
+			opts.torrents = max(1L, atol(argv[++i]));
+		} else if (arg == "--peers" && has_value) {
+			opts.peers = max(1L, atol(argv[++i]));
+		} else if (arg == "--duration" && has_value) {
+			opts.duration = max(0.1, atof(argv[++i]));
+		} else {
+			cout << "usage: " << argv[0] << " [--threads <max>] [--shards <n>]... [--torrents <n>] "
+				 << "[--peers <per_torrent>] [--duration <secs>]" << endl;
+			return 1;
+		}
+	}
+
+	printf("%zu torrents of %zu peers, compact, %.1f s per point, %u cores\n", opts.torrents, opts.peers,
+		   opts.duration, thread::hardware_concurrency());
+	printf("threads   ");
+	for (int threads = 1; threads <= opts.max_threads; threads *= 2) {
+		printf("%8d", threads);
+	}
+	printf("\n");
+	for (int shards : opts.shard_counts) {
+		printf("%3d shard%s", shards, shards == 1 ? " " : "s");
+		for (int threads = 1; threads <= opts.max_threads; threads *= 2) {
+			printf("%8.2f", run_point(opts, shards, threads) / 1e6);
+			fflush(stdout);
+		}
+		printf("  M announces/s\n");
+	}
+	return 0;
+}
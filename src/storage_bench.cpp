@@ -0,0 +1,179 @@
+#include <torrent_metadata.hpp>
+#include <torrent_state.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct StorageOptions {
+	string dir = ".";
+	int64_t size_mb = 1024;
+	int64_t piece_kb = 256;
+	int sync_every = 64; /* pieces between flushes, standing in for background writeback */
+	bool preallocate = true;
+	bool sparse = true;
+};
+
+/* Hashes are all zero: the benchmark never verifies, it only writes and reads */
+static void write_torrent(const string &path, int64_t file_length, int64_t piece_length)
+{
+	int64_t pieces = (file_length - 1) / piece_length + 1;
+	ofstream out(path, ios::binary);
+	out << "d8:announce30:http://127.0.0.1:8080/announce4:infod"
+		<< "6:lengthi" << file_length << "e"
+		<< "4:name11:payload.bin"
+		<< "12:piece lengthi" << piece_length << "e"
+		<< "6:pieces" << pieces * 20 << ":" << string(pieces * 20, '\0')
+		<< "ee";
+	if (!out) {
+		throw runtime_error("unable to write " + path);
+	}
+}
+
+/* How many extents the filesystem used for the file; -1 where FIEMAP isn't available */
+static long count_extents(int fd)
+{
+#ifdef __linux__
+	struct fiemap fm;
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) == 0) {
+		return fm.fm_mapped_extents;
+	}
+#else
+	(void)fd;
+#endif
+	return -1;
+}
+
+static double mb_per_sec(int64_t bytes, Clock::duration elapsed)
+{
+	return bytes / 1e6 / chrono::duration<double>(elapsed).count();
+}
+
+/*
+ * Write every piece in a random order, as a download would, then read
+ * the file back in piece order, as seeding or a later copy would, with
+ * the file evicted from the page cache first so the reads hit the disk
+ * and its layout.
+ */
+static void run_mode(const StorageOptions &opts, StorageMode mode)
+{
+	string base = opts.dir + "/storage_bench." + to_string(getpid());
+	string torrent_path = base + ".torrent";
+	string payload_path = base + ".bin";
+	int64_t file_length = opts.size_mb << 20;
+	int64_t piece_length = opts.piece_kb << 10;
+	write_torrent(torrent_path, file_length, piece_length);
+	unlink(payload_path.c_str());
+
+	try {
+		auto meta = make_shared<const TorrentMetadata>(torrent_path);
+		TorrentState state(meta, payload_path, mode);
+		int fd = open(payload_path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("unable to open " + payload_path + ": " + strerror(errno));
+		}
+
+		vector<int> order(meta->num_pieces);
+		iota(order.begin(), order.end(), 0);
+		mt19937 rng(1);
+		shuffle(order.begin(), order.end(), rng);
+		string data(piece_length, '\0');
+		generate(data.begin(), data.end(), [&rng]() { return static_cast<char>(rng()); });
+
+		auto start = Clock::now();
+		for (size_t i = 0; i < order.size(); i++) {
+			int index = order[i];
+			state.write_piece(index, index == meta->num_pieces - 1 ? data.substr(0, meta->piece_size(index)) : data);
+			if (opts.sync_every > 0 && (i + 1) % opts.sync_every == 0) {
+				fdatasync(fd);
+			}
+		}
+		fdatasync(fd);
+		auto write_time = Clock::now() - start;
+
+		long extents = count_extents(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+		start = Clock::now();
+		int64_t read = 0;
+		for (int index = 0; index < meta->num_pieces; index++) {
+			read += state.read_piece(index).size();
+		}
+		auto read_time = Clock::now() - start;
+		close(fd);
+
+		printf("%-11s extents %6ld  write %8.1f MB/s  sequential read %8.1f MB/s\n",
+			   mode == STORAGE_PREALLOCATE ? "preallocate" : "sparse", extents,
+			   mb_per_sec(file_length, write_time), mb_per_sec(read, read_time));
+	} catch (...) {
+		unlink(payload_path.c_str());
+		unlink(torrent_path.c_str());
+		throw;
+	}
+	unlink(payload_path.c_str());
+	unlink(torrent_path.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+	StorageOptions opts;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--dir" && has_value) {
+			opts.dir = argv[++i];
+		} else if (arg == "--size" && has_value) {
+			opts.size_mb = max(1L, atol(argv[++i]));
+		} else if (arg == "--piece" && has_value) {
+			opts.piece_kb = max(1L, atol(argv[++i]));
+		} else if (arg == "--sync-every" && has_value) {
+			opts.sync_every = max(0, atoi(argv[++i]));
+		} else if (arg == "--mode" && has_value) {
+			string mode(argv[++i]);
+			opts.preallocate = mode != "sparse";
+			opts.sparse = mode != "preallocate";
+		} else {
+			cout << "usage: " << argv[0] << " [--dir <dir>] [--size <MB>] [--piece <KB>] "
+				 << "[--sync-every <pieces>] [--mode preallocate|sparse|both]" << endl;
+			return 1;
+		}
+	}
+
+	printf("%lld MB in %lld KB pieces under %s, written in random order, flushed every %d pieces\n",
+		   static_cast<long long>(opts.size_mb), static_cast<long long>(opts.piece_kb),
+		   opts.dir.c_str(), opts.sync_every);
+	try {
+		if (opts.preallocate) {
+			run_mode(opts, STORAGE_PREALLOCATE);
+		}
+		if (opts.sparse) {
+			run_mode(opts, STORAGE_SPARSE);
+		}
+	} catch (const exception &e) {
+		cerr << "Error: " << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,411 @@
+#include <swarm.hpp>
+#include <utils.hpp>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+bool Swarm::upsert(const PeerRecord &peer)
+{
+	auto [slot, inserted] = index.insert(peer.peer_id);
+	if (inserted) {
+		*slot = static_cast<uint32_t>(peers.size());
+		peers.push_back(peer);
+		num_downloaded += peer.event == EVENT_COMPLETED;
+		num_ipv6 += peer.ipv6();
+		if (!dicts.empty()) {
+			dicts.emplace_back();
+			encode_dict(peers.size() - 1);
+		}
+		if (peer.seed()) {
+			swap_slots(peers.size() - 1, num_seeders++);
+		}
+		version++;
+		return true;
+	}
+
+	/* A client resending "completed" is still one download */
+	size_t at = *slot;
+	PeerRecord &existing_peer = peers[at];
+	bool was_seed = existing_peer.seed();
+	num_downloaded += peer.event == EVENT_COMPLETED && !was_seed;
+	num_ipv6 += peer.ipv6() - existing_peer.ipv6();
+	if (existing_peer.addr != peer.addr || existing_peer.port != peer.port) {
+		existing_peer.addr = peer.addr;
+		existing_peer.port = peer.port;
+		if (!dicts.empty()) {
+			encode_dict(at);
+		}
+		version++;
+	}
+	existing_peer.flags = peer.flags;
+	existing_peer.event = peer.event;
+	existing_peer.valid_until = peer.valid_until;
+
+	/* Moved across the seed/leecher split */
+	if (peer.seed() != was_seed) {
+		if (peer.seed()) {
+			swap_slots(at, num_seeders++);
+		} else {
+			swap_slots(at, --num_seeders);
+		}
+		version++;
+	}
+	return false;
+}
+
+void Swarm::swap_slots(size_t a, size_t b)
+{
+	if (a == b) {
+		return;
+	}
+	std::swap(peers[a], peers[b]);
+	if (!dicts.empty()) {
+		std::swap(dicts[a], dicts[b]);
+	}
+	*index.find(peers[a].peer_id) = static_cast<uint32_t>(a);
+	*index.find(peers[b].peer_id) = static_cast<uint32_t>(b);
+}
+
+/* The last seed fills a seed's hole, then the last peer fills the hole the split left */
+void Swarm::remove_at(size_t slot)
+{
+	num_ipv6 -= peers[slot].ipv6();
+	if (peers[slot].seed()) {
+		swap_slots(slot, --num_seeders);
+		slot = num_seeders;
+	}
+	swap_slots(slot, peers.size() - 1);
+	index.erase(peers.back().peer_id);
+	peers.pop_back();
+	if (!dicts.empty()) {
+		dicts.pop_back();
+	}
+	version++;
+}
+
+size_t Swarm::slot_of(const Id20 &peer_id) const
+{
+	const uint32_t *slot = index.find(peer_id);
+	return slot ? *slot : peers.size();
+}
+
+bool Swarm::remove(const Id20 &peer_id)
+{
+	size_t slot = slot_of(peer_id);
+	if (slot == peers.size()) {
+		return false;
+	}
+	remove_at(slot);
+	return true;
+}
+
+PeerRecord *Swarm::find(const Id20 &peer_id)
+{
+	size_t slot = slot_of(peer_id);
+	return slot == peers.size() ? nullptr : &peers[slot];
+}
+
+/*
+ * Appends up to count distinct peers from slots [begin, end), other than
+ * slot skip. Draws positions with replacement and skips repeats,
+ * remembered in a small open-addressed set, until count distinct peers
+ * are picked: O(count) without touching the rest of the range, and the
+ * picks come out in random order. From half the range up it is cheaper
+ * to shuffle all of it. The skipped slot is left out by sampling from
+ * one fewer position and shifting past it.
+ */
+void Swarm::sample_range(size_t count, size_t begin, size_t end, size_t skip, std::mt19937 &rng,
+						 std::vector<const PeerRecord*> &out) const
+{
+	bool skipping = skip >= begin && skip < end;
+	size_t candidates = end - begin - skipping;
+	if (count == 0 || candidates == 0) {
+		return;
+	}
+	auto slot_at = [begin, skip, skipping](size_t position) {
+		size_t slot = begin + position;
+		return skipping && slot >= skip ? slot + 1 : slot;
+	};
+
+	size_t first = out.size();
+	if (count * 2 >= candidates) {
+		for (size_t position = 0; position < candidates; position++) {
+			out.push_back(&peers[slot_at(position)]);
+		}
+		std::shuffle(out.begin() + first, out.end(), rng);
+		out.resize(first + std::min(count, candidates));
+		return;
+	}
+
+	/* At most a quarter full, so probe runs stay short */
+	thread_local std::vector<uint32_t> seen;
+	size_t mask = std::bit_ceil(count * 4) - 1;
+	seen.assign(mask + 1, UINT32_MAX);
+
+	std::uniform_int_distribution<uint32_t> draw(0, static_cast<uint32_t>(candidates - 1));
+	while (out.size() - first < count) {
+		uint32_t position = draw(rng);
+		size_t i = position & mask;
+		while (seen[i] != UINT32_MAX && seen[i] != position) {
+			i = (i + 1) & mask;
+		}
+		if (seen[i] == position) {
+			continue;
+		}
+		seen[i] = position;
+		out.push_back(&peers[slot_at(position)]);
+	}
+}
+
+void Swarm::sample(size_t count, const Id20 &exclude_id, std::mt19937 &rng,
+				   std::vector<const PeerRecord*> &out) const
+{
+	out.clear();
+	sample_range(count, 0, peers.size(), slot_of(exclude_id), rng, out);
+}
+
+/*
+ * count peers for caller out of a larger swarm. Without zones, the peers
+ * that complement the caller (seeds for a leecher, leechers for a seed)
+ * are sampled from their side of the split first and the caller's own
+ * kind makes up the rest.
+ *
+ * With zones, from a uniform sample LOCALITY_OVERSAMPLE times bigger
+ * bucketed by rank. Peers in the caller's zone fill the response except
+ * for a LOCALITY_REMOTE_SHARE reserved for other zones; whichever side
+ * runs short, the other makes up. Zone comes before kind: within each
+ * side the complements go first, so a same-zone peer of the caller's own
+ * kind still beats a remote complement. The sample is already shuffled,
+ * so order within a bucket stays random.
+ */
+void Swarm::select(size_t count, const PeerRecord &caller, const Locality &locality,
+				   std::mt19937 &rng, std::vector<const PeerRecord*> &out) const
+{
+	if (!locality.enabled()) {
+		size_t skip = slot_of(caller.peer_id);
+		out.clear();
+		if (caller.seed()) {
+			sample_range(count, num_seeders, peers.size(), skip, rng, out);
+			sample_range(count - out.size(), 0, num_seeders, skip, rng, out);
+		} else {
+			sample_range(count, 0, num_seeders, skip, rng, out);
+			sample_range(count - out.size(), num_seeders, peers.size(), skip, rng, out);
+		}
+		return;
+	}
+
+	thread_local std::vector<const PeerRecord*> pool;
+	thread_local std::vector<const PeerRecord*> buckets[4]; /* [local * 2 + complements] */
+	sample(count * LOCALITY_OVERSAMPLE, caller.peer_id, rng, pool);
+
+	uint64_t caller_zone = locality.enabled() ? locality.zone_of(caller) : 0;
+	for (auto &bucket : buckets) {
+		bucket.clear();
+	}
+	for (const PeerRecord *peer : pool) {
+		bool local = caller_zone != 0 && locality.zone_of(*peer) == caller_zone;
+		bool complements = peer->seed() != caller.seed();
+		buckets[local * 2 + complements].push_back(peer);
+	}
+
+	out.clear();
+	auto take = [&](std::vector<const PeerRecord*> &bucket, size_t limit) {
+		size_t n = std::min(bucket.size(), limit - std::min(limit, out.size()));
+		out.insert(out.end(), bucket.begin(), bucket.begin() + n);
+		bucket.erase(bucket.begin(), bucket.begin() + n);
+	};
+
+	size_t remote = buckets[0].size() + buckets[1].size();
+	size_t remote_share = std::min(remote, static_cast<size_t>(std::ceil(count * LOCALITY_REMOTE_SHARE)));
+	take(buckets[3], count - remote_share);
+	take(buckets[2], count - remote_share);
+	take(buckets[1], count);
+	take(buckets[0], count);
+	take(buckets[3], count);
+	take(buckets[2], count);
+}
+
+void Swarm::tick_rate(double seconds)
+{
+	if (seconds > 0) {
+		rate += 0.2f * (static_cast<float>(tick_announces / seconds) - rate);
+	}
+	tick_announces = 0;
+}
+
+size_t Swarm::random_start(std::mt19937 &rng) const
+{
+	if (peers.empty()) {
+		return 0;
+	}
+	return std::uniform_int_distribution<size_t>(0, peers.size() - 1)(rng);
+}
+
+void Swarm::refresh_cache() const
+{
+	if (cached_version == version) {
+		return;
+	}
+
+	FragmentList *lists[] = {&cached_peers, &cached_peers6, &cached_dicts};
+	for (FragmentList *list : lists) {
+		list->bytes.clear();
+		list->offsets.assign(1, 0);
+	}
+
+	/* Every list gets an offset per slot, empty where the peer is of the other family */
+	for (size_t slot = 0; slot < peers.size(); slot++) {
+		const PeerRecord &peer = peers[slot];
+		peer.append_compact(peer.ipv6() ? cached_peers6.bytes : cached_peers.bytes);
+		if (!dicts.empty()) {
+			cached_dicts.bytes.append(dicts[slot].bytes, dicts[slot].size);
+		} else {
+			peer.append_dict(cached_dicts.bytes);
+		}
+		for (FragmentList *list : lists) {
+			list->offsets.push_back(list->bytes.size());
+		}
+	}
+	cached_version = version;
+}
+
+void Swarm::encode_dict(size_t slot) const
+{
+	thread_local std::string entry;
+	entry.clear();
+	peers[slot].append_dict(entry);
+	dicts[slot].size = static_cast<uint8_t>(entry.size());
+	std::memcpy(dicts[slot].bytes, entry.data(), entry.size());
+}
+
+/* From here on every join, move and leave keeps the fragments in step */
+void Swarm::keep_dicts() const
+{
+	if (!dicts.empty()) {
+		return;
+	}
+	dicts.resize(peers.size());
+	for (size_t slot = 0; slot < peers.size(); slot++) {
+		encode_dict(slot);
+	}
+}
+
+/*
+ * Copy a cached list starting at slot `start` and wrapping around, minus
+ * the fragment at slot `skip` (the caller). At most three memcpys.
+ */
+void Swarm::append_rotated(const FragmentList &list, size_t start, size_t skip, std::string &out)
+{
+	const std::vector<uint32_t> &off = list.offsets;
+	size_t n = off.size() - 1;
+	auto copy = [&](size_t from, size_t to) {
+		if (to > from) {
+			out.append(list.bytes, from, to - from);
+		}
+	};
+
+	if (skip >= n) {
+		copy(off[start], off[n]);
+		copy(0, off[start]);
+	} else if (skip >= start) {
+		copy(off[start], off[skip]);
+		copy(off[skip + 1], off[n]);
+		copy(0, off[start]);
+	} else {
+		copy(off[start], off[n]);
+		copy(0, off[skip]);
+		copy(off[skip + 1], off[start]);
+	}
+}
+
+void Swarm::append_peers(bool compact, size_t numwant, const PeerRecord &caller, const Locality &locality,
+						 std::mt19937 &rng, std::string &out) const
+{
+	size_t skip = slot_of(caller.peer_id);
+	size_t candidates = peers.size() - (skip < peers.size() ? 1 : 0);
+
+	if (candidates > numwant) {
+		thread_local std::vector<const PeerRecord*> picked;
+		select(numwant, caller, locality, rng, picked);
+
+		if (!compact) {
+			keep_dicts();
+			/* Random slots of a big swarm are cache misses; start them all before copying */
+			for (const PeerRecord *peer : picked) {
+				const char *bytes = dicts[peer - peers.data()].bytes;
+				__builtin_prefetch(bytes);
+				__builtin_prefetch(bytes + DICT_FRAGMENT_MAX - 1);
+			}
+			out += "5:peersl";
+			for (const PeerRecord *peer : picked) {
+				const DictFragment &dict = dicts[peer - peers.data()];
+				out.append(dict.bytes, dict.size);
+			}
+			out += 'e';
+			return;
+		}
+
+		size_t len4 = 0, len6 = 0;
+		for (const PeerRecord *peer : picked) {
+			if (peer->ipv6()) len6 += 18; else len4 += 6;
+		}
+		out += "5:peers";
+		append_bencode_string_header(out, len4);
+		for (const PeerRecord *peer : picked) {
+			if (!peer->ipv6()) peer->append_compact(out);
+		}
+		if (len6 > 0) {
+			out += "6:peers6";
+			append_bencode_string_header(out, len6);
+			for (const PeerRecord *peer : picked) {
+				if (peer->ipv6()) peer->append_compact(out);
+			}
+		}
+		return;
+	}
+
+	/* Whole swarm fits: send all of it, rotated to a random start */
+	size_t start = random_start(rng);
+	refresh_cache();
+
+	if (!compact) {
+		out += "5:peersl";
+		append_rotated(cached_dicts, start, skip, out);
+		out += 'e';
+		return;
+	}
+
+	bool caller_v6 = skip < peers.size() && peers[skip].ipv6();
+	bool caller_v4 = skip < peers.size() && !peers[skip].ipv6();
+	size_t count6 = num_ipv6 - caller_v6;
+	size_t count4 = peers.size() - num_ipv6 - caller_v4;
+
+	out += "5:peers";
+	append_bencode_string_header(out, count4 * 6);
+	append_rotated(cached_peers, start, skip, out);
+	if (count6 > 0) {
+		out += "6:peers6";
+		append_bencode_string_header(out, count6 * 18);
+		append_rotated(cached_peers6, start, skip, out);
+	}
+}
+
+void Swarm::append_compact(size_t numwant, const PeerRecord &caller, const Locality &locality,
+						   std::mt19937 &rng, std::string &out) const
+{
+	size_t skip = slot_of(caller.peer_id);
+	size_t candidates = peers.size() - (skip < peers.size() ? 1 : 0);
+
+	if (candidates > numwant) {
+		thread_local std::vector<const PeerRecord*> picked;
+		select(numwant, caller, locality, rng, picked);
+		for (const PeerRecord *peer : picked) {
+			if (peer->ipv6() == caller.ipv6()) peer->append_compact(out);
+		}
+		return;
+	}
+
+	refresh_cache();
+	append_rotated(caller.ipv6() ? cached_peers6 : cached_peers, random_start(rng), skip, out);
+}
@@ -1,87 +1,201 @@
 #include <torrent_metadata.hpp>
 #include <utils.hpp>
 #include <bencode.hpp>
-#include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* SHA1 hashes are 20 bytes */
 #define PIECE_HASH_SIZE 20
 
-TorrentMetadata::TorrentMetadata(const std::string& torrent_filename) {
-    parse(torrent_filename);
+TorrentMetadata::TorrentMetadata(const std::string& torrent_filename)
+    : mapped_data(nullptr), mapped_size(0) {
+    map_file(torrent_filename);
+    try {
+        parse(std::string_view(mapped_data, mapped_size));
+    } catch (...) {
+        unmap_file();
+        throw;
+    }
+}
+
+TorrentMetadata::~TorrentMetadata() {
+    unmap_file();
 }
 
-void TorrentMetadata::parse(const std::string& torrent_filename) {
-    std::ifstream file(torrent_filename, std::ios::binary);
-    if (!file) {
+/*
+ * The .torrent stays mapped for the lifetime of the metadata: piece_hashes
+ * is a view straight into it, so a multi-MB "pieces" blob is never copied
+ * and only the pages actually touched during verification become resident.
+ */
+void TorrentMetadata::map_file(const std::string& torrent_filename) {
+    int fd = open(torrent_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
         throw std::runtime_error("Could not open torrent file: " + torrent_filename);
     }
 
-    std::string file_data(
-        (std::istreambuf_iterator<char>(file)),
-        std::istreambuf_iterator<char>()
-    );
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Error reading torrent file");
+    }
 
-    if (file.bad()) {
-		throw std::runtime_error("Error reading torrent file");
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Error reading torrent file");
     }
 
-    bencode::data data = bencode::decode(file_data);
-    auto root_dict = std::get<bencode::dict>(data);
+    mapped_data = static_cast<const char*>(addr);
+    mapped_size = st.st_size;
+}
+
+void TorrentMetadata::unmap_file() {
+    if (mapped_data) {
+        munmap(const_cast<char*>(mapped_data), mapped_size);
+        mapped_data = nullptr;
+    }
+}
 
-    if (root_dict.count("announce")) {
-        announce_url = std::get<bencode::string>(root_dict["announce"]);
-    } else {
-        throw std::runtime_error("No announce URL in torrent file");
+/* A list of tiers, each a list of URLs; anything else in it is skipped, as are empty tiers */
+static std::vector<std::vector<std::string>> parse_announce_list(const bencode::data_view &value) {
+    std::vector<std::vector<std::string>> announce_tiers;
+    auto tiers = std::get_if<bencode::list_view>(&value.base());
+    if (!tiers) {
+        return announce_tiers;
     }
-    if (!root_dict.count("info")) {
-        throw std::runtime_error("No info dictionary in torrent file");
+    for (const auto &tier_value : *tiers) {
+        auto tier = std::get_if<bencode::list_view>(&tier_value.base());
+        if (!tier) {
+            continue;
+        }
+        std::vector<std::string> urls;
+        for (const auto &url : *tier) {
+            if (auto str = std::get_if<bencode::string_view>(&url.base())) {
+                urls.emplace_back(*str);
+            }
+        }
+        if (!urls.empty()) {
+            announce_tiers.push_back(std::move(urls));
+        }
+    }
+    return announce_tiers;
+}
+
+void TorrentMetadata::parse(std::string_view contents) {
+    const char *p = contents.data();
+    const char *end = p + contents.size();
+
+    if (*p != 'd') {
+        throw std::runtime_error("Torrent file is not a bencoded dictionary");
+    }
+    p++;
+
+    /*
+     * Walk the root dictionary one entry at a time rather than decoding it
+     * in one go, so we know exactly where the info dictionary starts and
+     * ends in the file. Its info_hash is the SHA1 of those original bytes.
+     */
+    bool has_announce = false;
+    std::string_view info_bytes;
+    bencode::dict_view info;
+    while (p != end && *p != 'e') {
+        auto key = std::get<bencode::string_view>(bencode::decode_view_some(p, end));
+        const char *value_start = p;
+        bencode::data_view value = bencode::decode_view_some(p, end);
+
+        if (key == "announce") {
+            announce_url = std::get<bencode::string_view>(value);
+            has_announce = true;
+        } else if (key == "announce-list") {
+            announce_tiers = parse_announce_list(value);
+        } else if (key == "info") {
+            info = std::get<bencode::dict_view>(value);
+            info_bytes = std::string_view(value_start, p - value_start);
+        }
+    }
+    if (p == end) {
+        throw std::runtime_error("Torrent file is truncated");
     }
 
-    auto info = std::get<bencode::dict>(root_dict["info"]);
+    /* With an announce-list, announce is only there for clients that predate it */
+    if (announce_tiers.empty()) {
+        if (!has_announce) {
+            throw std::runtime_error("No announce URL in torrent file");
+        }
+        announce_tiers.push_back({announce_url});
+    } else if (!has_announce) {
+        announce_url = announce_tiers[0][0];
+    }
+    if (info_bytes.empty()) {
+        throw std::runtime_error("No info dictionary in torrent file");
+    }
 
 	/* Name of file to be downloaded */
     if (info.count("name")) {
-        file_name = std::get<bencode::string>(info["name"]);
+        file_name = std::get<bencode::string_view>(info["name"]);
     } else {
         throw std::runtime_error("No file name in torrent");
     }
 
 	/* Total length of file to be downloaded */
     if (info.count("length")) {
-        file_length = std::get<bencode::integer>(info["length"]);
+        file_length = std::get<bencode::integer_view>(info["length"]);
     } else {
         throw std::runtime_error("No file length in torrent");
     }
 
 	/* Size of each piece in bytes */
     if (info.count("piece length")) {
-        piece_length = std::get<bencode::integer>(info["piece length"]);
+        piece_length = std::get<bencode::integer_view>(info["piece length"]);
     } else {
         throw std::runtime_error("No piece length in torrent");
     }
 
 	/* SHA1 hashes of pieces for verification */
     if (info.count("pieces")) {
-        std::string pieces_str = std::get<bencode::string>(info["pieces"]);
-
-        for (size_t i = 0; i < pieces_str.length(); i += PIECE_HASH_SIZE) {
-            if (i + PIECE_HASH_SIZE <= pieces_str.length()) {
-                piece_hashes.push_back(pieces_str.substr(i, PIECE_HASH_SIZE));
-            }
+        piece_hashes = std::get<bencode::string_view>(info["pieces"]);
+        if (piece_hashes.size() % PIECE_HASH_SIZE != 0) {
+            throw std::runtime_error("Piece hashes are not a whole number of SHA1 digests");
         }
-
-        num_pieces = piece_hashes.size();
+        num_pieces = piece_hashes.size() / PIECE_HASH_SIZE;
     } else {
         throw std::runtime_error("No pieces in torrent");
     }
 
-    std::string bencoded_info = bencode::encode(info);
-    calculate_info_hash(bencoded_info);
+    /* Every piece but the last is full, so the last one's size is in (0, piece_length] */
+    if (file_length <= 0 || piece_length <= 0) {
+        throw std::runtime_error("File length and piece length must be positive");
+    }
+    if (num_pieces != (file_length - 1) / piece_length + 1) {
+        throw std::runtime_error("Torrent has " + std::to_string(num_pieces) + " piece hashes, expected " +
+                                 std::to_string((file_length - 1) / piece_length + 1));
+    }
+
+    calculate_info_hash(info_bytes);
+}
+
+std::string_view TorrentMetadata::piece_hash(int index) const {
+    return piece_hashes.substr(static_cast<size_t>(index) * PIECE_HASH_SIZE, PIECE_HASH_SIZE);
+}
+
+/* Byte offset of a piece in the payload, 64-bit so multi-TB files work */
+int64_t TorrentMetadata::piece_offset(int index) const {
+    return static_cast<int64_t>(index) * piece_length;
 }
 
-void TorrentMetadata::calculate_info_hash(const std::string& bencoded_info) {
+/* Every piece is piece_length except the last, which holds the remainder */
+int64_t TorrentMetadata::piece_size(int index) const {
+    if (index == num_pieces - 1) {
+        return file_length - piece_offset(index);
+    }
+    return piece_length;
+}
+
+void TorrentMetadata::calculate_info_hash(std::string_view bencoded_info) {
     info_hash = sha1_hash(bencoded_info);
 }
 
@@ -91,6 +205,13 @@ void TorrentMetadata::print_info() const {
     std::cout << "File size: " << file_length << " bytes" << std::endl;
     std::cout << "Piece length: " << piece_length << " bytes" << std::endl;
     std::cout << "Number of pieces: " << num_pieces << std::endl;
-    std::cout << "Tracker URL: " << announce_url << std::endl;
+    for (size_t tier = 0; tier < announce_tiers.size(); tier++) {
+        std::cout << (announce_tiers.size() == 1 ? std::string("Tracker URL:")
+                                                 : "Tracker tier " + std::to_string(tier + 1) + ":");
+        for (const std::string &url : announce_tiers[tier]) {
+            std::cout << " " << url;
+        }
+        std::cout << std::endl;
+    }
     std::cout << "Info hash (hex): " << hash_to_hex(info_hash) << std::endl;
 }
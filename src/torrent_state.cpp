@@ -1,169 +1,262 @@
 #include <torrent_state.hpp>
-#include <fstream>
 #include <iostream>
 #include <utils.hpp>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 
-TorrentState::TorrentState(const TorrentMetadata &meta, const std::string &path)
-	: metadata(meta), file_path(path)
+TorrentState::TorrentState(std::shared_ptr<const TorrentMetadata> meta, const std::string &path,
+						   StorageMode mode)
+	: done_bmap(meta->num_pieces),
+	  in_progress_bmap(meta->num_pieces),
+	  metadata(std::move(meta)),
+	  file_path(path),
+	  file_fd(-1)
 {
-	done_bmap.resize(metadata.piece_hashes.size(), false);
-	in_progress_bmap.resize(metadata.piece_hashes.size(), false);
+	bool existed = access(file_path.c_str(), F_OK) == 0;
+	open_file();
 
-	std::ifstream file(file_path, std::ios::binary);
-	if (!file.good()) {
+	if (!existed) {
 		std::cout << "file unavailable locally. starting as leecher..." << std::endl;
+		allocate_file(mode);
 		return;
 	}
-	
-	std::cout << "file available locally. verifying pieces..." << std::endl;
-	for (size_t i = 0; i < metadata.piece_hashes.size(); i++) {
-		file.seekg(i * metadata.piece_length);
 
-		size_t piece_size = metadata.piece_length;
-		if (i == metadata.piece_hashes.size() - 1) {
-			piece_size = metadata.file_length - (i * metadata.piece_length);
+	std::cout << "file available locally. verifying pieces..." << std::endl;
+	for (int i = 0; i < metadata->num_pieces; i++) {
+		if (verify_piece(i, read_piece(i))) {
+			done_bmap.set(i);
 		}
-		std::vector<char> piece_data(piece_size);
-		file.read(piece_data.data(), piece_size);
+	}
+
+	std::cout << "have " << done_bmap.count() << " / "  << metadata->num_pieces
+		<< std::endl;
 
-		std::string piece_string(piece_data.begin(), piece_data.end());
-		done_bmap[i] = verify_piece(i, piece_string);
+	/* Left over from an interrupted run, may still be short */
+	if (!done_bmap.all()) {
+		allocate_file(mode);
 	}
+}
 
-	int pieces_cnt = 0;
-	for (bool b : done_bmap) {
-		if (b) pieces_cnt++;
+TorrentState::~TorrentState()
+{
+	if (file_fd >= 0) {
+		close(file_fd);
 	}
+}
 
-	std::cout << "have " << pieces_cnt << " / "  << metadata.piece_hashes.size()
-		<< std::endl;
+void TorrentState::open_file()
+{
+	file_fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (file_fd < 0 && errno == EACCES) {
+		/* A read-only copy is still fine to seed from */
+		file_fd = open(file_path.c_str(), O_RDONLY);
+	}
+	if (file_fd < 0) {
+		throw std::runtime_error("unable to open " + file_path + ": " + strerror(errno));
+	}
+}
 
+/*
+ * Grow the file to its final length before any piece arrives. With
+ * fallocate the filesystem can hand out one contiguous extent instead of
+ * fragmenting it as pieces land out of order, which keeps later
+ * sequential reads for seeding fast.
+ */
+void TorrentState::allocate_file(StorageMode mode)
+{
+	struct stat st;
+	if (fstat(file_fd, &st) != 0) {
+		throw std::runtime_error("unable to stat " + file_path + ": " + strerror(errno));
+	}
+	if (st.st_size >= metadata->file_length) {
+		return;
+	}
+
+#ifdef __linux__
+	struct statvfs vfs;
+	if (mode == STORAGE_PREALLOCATE && fstatvfs(file_fd, &vfs) == 0 &&
+		static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize <
+		static_cast<uint64_t>(metadata->file_length - st.st_size)) {
+		std::cerr << "not enough free space to preallocate, using a sparse file" << std::endl;
+		mode = STORAGE_SPARSE;
+	}
+
+	if (mode == STORAGE_PREALLOCATE) {
+		if (fallocate(file_fd, 0, 0, metadata->file_length) == 0) {
+			std::cout << "preallocated " << metadata->file_length << " bytes" << std::endl;
+			return;
+		}
+		std::cerr << "fallocate failed (" << strerror(errno)
+				  << "), falling back to a sparse file" << std::endl;
+		/* A failed fallocate can keep whatever it managed to reserve */
+		if (ftruncate(file_fd, st.st_size) != 0) {
+			throw std::runtime_error("unable to size " + file_path + ": " + strerror(errno));
+		}
+	}
+#else
+	(void)mode;
+#endif
+
+	if (ftruncate(file_fd, metadata->file_length) != 0) {
+		throw std::runtime_error("unable to size " + file_path + ": " + strerror(errno));
+	}
 }
 
 bool TorrentState::verify_piece(int index, const std::string &piece_string)
 {
-	return sha1_hash(piece_string) == metadata.piece_hashes[index];
+	return sha1_hash(piece_string) == metadata->piece_hash(index);
 }
 
 bool TorrentState::have_piece(int index)
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	return done_bmap[index];
+	return done_bmap.test(index);
 }
 
-int TorrentState::get_next_piece_to_download()
+/* First piece the peer has that is neither done nor being fetched elsewhere */
+int TorrentState::get_next_piece_to_download(const Bitfield &peer_bitfield)
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	for (size_t i = 0; i < done_bmap.size(); i++) {
-		if (!done_bmap[i] && !in_progress_bmap[i]) {
-			return i;
-		}
+	size_t index = peer_bitfield.find_first_missing(done_bmap, in_progress_bmap);
+	if (index == Bitfield::npos) {
+		return -1;
 	}
-	return -1;
+	return index;
+}
+
+bool TorrentState::is_interesting(const Bitfield &peer_bitfield)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	return peer_bitfield.has_missing(done_bmap);
 }
 
 void TorrentState::set_in_progress(int index)
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	in_progress_bmap[index] = true;
+	in_progress_bmap.set(index);
+}
+
+void TorrentState::clear_in_progress(int index)
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	in_progress_bmap.reset(index);
 }
 
 void TorrentState::set_complete(int index)
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	done_bmap[index] = true;
-	in_progress_bmap[index] = false;
+	done_bmap.set(index);
+	in_progress_bmap.reset(index);
 }
 
-std::vector<bool> TorrentState::get_bitfield() 
+std::string TorrentState::get_wire_bitfield()
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	return done_bmap;
+	return done_bmap.to_wire();
 }
 
 void TorrentState::write_piece(int index, const std::string &data)
 {
 	size_t indecks = static_cast<size_t>(index);
-	assert(index >= 0 && indecks < metadata.piece_hashes.size());
-
-	std::lock_guard<std::mutex> lock(file_mutex);
-	std::fstream file(file_path, std::ios::out | std::ios::in | std::ios::binary);
-	if (!file.is_open()) {
-		file.open(file_path, std::ios::out | std::ios::binary); /* Create file */
-		file.close();
-		file.open(file_path, std::ios::out | std::ios::in | std::ios::binary);
-	}
+	assert(index >= 0 && indecks < static_cast<size_t>(metadata->num_pieces));
 
-	if (!file.is_open()) {
-		throw std::runtime_error("unable to access file when should have");
+	off_t offset = metadata->piece_offset(index);
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t n = pwrite(file_fd, data.data() + written, data.size() - written, offset + written);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			throw std::runtime_error("unable to write " + file_path + ": " + strerror(errno));
+		}
+		written += n;
 	}
-
-	file.seekp(index * metadata.piece_length);
-	file.write(data.data(), data.size());
-	file.flush();
 }
 
+/* Returns fewer bytes than the piece size if the file is short */
 std::string TorrentState::read_piece(int index)
 {
 	size_t indecks = static_cast<size_t>(index);
-	assert(index >= 0 && indecks < metadata.piece_hashes.size());
-
-	std::lock_guard<std::mutex> lock(file_mutex);
-	std::ifstream file(file_path, std::ios::binary);
-	if (!file.good()) {
-		throw std::runtime_error("unable to access file when should have");
-	}
+	assert(index >= 0 && indecks < static_cast<size_t>(metadata->num_pieces));
 
-	file.seekg(index * metadata.piece_length);
-	size_t piece_size = metadata.piece_length;
-	if (indecks == metadata.piece_hashes.size() - 1) {
-		piece_size = metadata.file_length - (indecks * metadata.piece_length);
+	off_t offset = metadata->piece_offset(index);
+	std::string piece_string(metadata->piece_size(index), '\0');
+	size_t got = 0;
+	while (got < piece_string.size()) {
+		ssize_t n = pread(file_fd, &piece_string[got], piece_string.size() - got, offset + got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			throw std::runtime_error("unable to read " + file_path + ": " + strerror(errno));
+		}
+		if (n == 0) break;
+		got += n;
 	}
-	std::vector<char> piece_data(piece_size);
-	file.read(piece_data.data(), piece_size);
-	std::string piece_string(piece_data.begin(), piece_data.end());
+	piece_string.resize(got);
 	return piece_string;
 }
 
 bool TorrentState::is_file_complete()
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	for (bool b : done_bmap) {
-		if(!b) return false;
-	}
-	return true;
+	return done_bmap.all();
 }
 
-int TorrentState::bytes_left()
+int64_t TorrentState::bytes_left()
 {
 	std::lock_guard<std::mutex> lock(state_mutex);
-	int missing_cnt = 0;
-	int bytes_left;
-	for (bool b : done_bmap) {
-		if(!b) missing_cnt++;
-	}
-	if (!done_bmap[done_bmap.size()-1]) {
-		int last_piece_size = metadata.file_length -
-			((done_bmap.size()-1) * metadata.piece_length);
-		bytes_left = (missing_cnt - 1) * metadata.piece_length + last_piece_size;
+	int64_t missing_cnt = done_bmap.size() - done_bmap.count();
+	int64_t bytes_left;
+	if (!done_bmap.test(done_bmap.size()-1)) {
+		int64_t last_piece_size = metadata->piece_size(done_bmap.size()-1);
+		bytes_left = (missing_cnt - 1) * metadata->piece_length + last_piece_size;
 	} else {
-		bytes_left = missing_cnt * metadata.piece_length;
+		bytes_left = missing_cnt * metadata->piece_length;
 	}
 	return bytes_left;
 }
 
+void TorrentState::add_uploaded(int64_t n)
+{
+	uploaded_bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+void TorrentState::add_downloaded(int64_t n)
+{
+	downloaded_bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+int64_t TorrentState::uploaded()
+{
+	return uploaded_bytes.load(std::memory_order_relaxed);
+}
+
+int64_t TorrentState::downloaded()
+{
+	return downloaded_bytes.load(std::memory_order_relaxed);
+}
+
 int TorrentState::get_total_pieces()
 {
-	return metadata.piece_hashes.size();
+	return metadata->num_pieces;
+}
+
+int64_t TorrentState::get_piece_length()
+{
+	return metadata->piece_length;
 }
 
-int TorrentState::get_piece_length()
+int64_t TorrentState::get_piece_size(int index)
 {
-	return metadata.piece_length;
+	return metadata->piece_size(index);
 }
 
-TorrentMetadata TorrentState::get_metadata()
+/* Immutable after parsing, so no lock is needed to read it */
+const TorrentMetadata &TorrentState::get_metadata()
 {
-	return metadata;
+	return *metadata;
 }
@@ -1,108 +1,400 @@
-#include <bencode.hpp>
-#include <peer_info.hpp>
 #include <tracker.hpp>
+#include <utils.hpp>
+#include <boost/endian/conversion.hpp>
 #include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstring>
 
-Tracker::Tracker(int interval, int timeout)
-	: announce_interval(interval), peer_timeout(timeout) {}
-
-std::string Tracker::handle_announce(const std::string &info_hash,
-							const std::string &peer_id,
-							const std::string &ip,
-							uint16_t port,
-							const std::string &event)
-{
-	PeerInfo peer(peer_id, ip, port);
-	peer.last_announce = time(nullptr);
-	peer.status = event;
-    if (event == "stopped") {
-        auto& peer_list = torrents[info_hash];
-        peer_list.erase(
-            std::remove_if(peer_list.begin(), peer_list.end(),
-                [&peer_id](const PeerInfo& p) { return p.peer_id == peer_id; }),
-            peer_list.end()
-        );
-		cleanup_inactive_peers();
-    } else {
-		update_peer(info_hash, peer);
-		cleanup_inactive_peers();
-	}
-	return generate_response(info_hash, peer_id);
-}
-
-std::string Tracker::generate_response(const std::string &info_hash, const std::string &caller_id)
-{
-    auto it = torrents.find(info_hash);
-    if (it == torrents.end()) {
-        bencode::dict response;
-        response["interval"] = (long long)announce_interval;
-        response["peers"] = bencode::list();
-        return bencode::encode(response);
-    }
-
-    const std::vector<PeerInfo> &peer_list = it->second;
-
-    bencode::list peers;
-    for (const auto &peer : peer_list) {
-		if (peer.peer_id == caller_id) {
-			continue;
+Tracker::Tracker(int interval, int timeout, int num_shards)
+	: announce_interval(interval),
+	  peer_timeout(timeout),
+	  scaled_interval(interval)
+{
+	time_t now = time(nullptr);
+	for (int i = 0; i < std::max(1, num_shards); i++) {
+		shards.push_back(std::make_unique<Shard>(timeout + 2, now));
+	}
+}
+
+/*
+ * info_hashes are SHA-1 digests, so any of their bytes are uniform. The
+ * trailing ones are used because a cluster node only sees info_hashes
+ * from the ring arcs it owns (hash_ring.hpp), and those arcs are picked
+ * by the leading bytes.
+ */
+Tracker::Shard &Tracker::shard_for(const Id20 &info_hash) const
+{
+	uint64_t key;
+	std::memcpy(&key, info_hash.data() + info_hash.size() - sizeof(key), sizeof(key));
+	return *shards[key % shards.size()];
+}
+
+/* Drops an empty swarm but remembers how many times it was downloaded */
+void Tracker::erase_swarm(Shard &shard, const Id20 &info_hash)
+{
+	Swarm *swarm = shard.torrents.find(info_hash);
+	uint32_t downloaded = static_cast<uint32_t>(swarm->downloaded());
+	shard.torrents.erase(info_hash);
+	if (downloaded > 0) {
+		*shard.retired_downloads.insert(info_hash).first = {downloaded, static_cast<uint32_t>(time(nullptr))};
+	}
+}
+
+Swarm *Tracker::update_swarm(Shard &shard, const Id20 &info_hash, const PeerRecord &peer)
+{
+	if (peer.event == EVENT_STOPPED) {
+		Swarm *swarm = shard.torrents.find(info_hash);
+		if (!swarm) {
+			return nullptr;
+		}
+		shard.num_peers -= swarm->remove(peer.peer_id);
+		if (swarm->empty()) {
+			erase_swarm(shard, info_hash);
+			return nullptr;
 		}
-        bencode::dict peer_dict;
-        peer_dict["peer id"] = peer.peer_id;
-        peer_dict["ip"] = peer.ip;
-        peer_dict["port"] = (long long)peer.port;
-        peers.push_back(peer_dict);
-    }
+		return swarm;
+	}
 
-    bencode::dict response;
-    response["interval"] = (long long)announce_interval;
-    response["peers"] = peers;
+	auto [swarm, created] = shard.torrents.insert(info_hash);
+	if (created && !shard.retired_downloads.empty()) {
+		if (const RetiredSwarm *retired = shard.retired_downloads.find(info_hash)) {
+			swarm->set_downloaded(retired->downloaded);
+			shard.retired_downloads.erase(info_hash);
+		}
+	}
+	if (swarm->upsert(peer)) {
+		/* Expired once valid_until has passed; re-announces push it out lazily */
+		shard.num_peers++;
+		PeerRecord *record = swarm->find(peer.peer_id);
+		record->expires = static_cast<uint32_t>(
+			shard.expiry.schedule(peer.valid_until + 1, info_hash, peer.peer_id));
+	}
+	return swarm;
+}
 
-    return bencode::encode(response);
+/* The load-scaled interval times the torrent's own stretch (see update_load()), then jittered */
+int Tracker::interval_for(const Swarm *swarm, std::mt19937 &rng) const
+{
+	double interval = scaled_interval.load(std::memory_order_relaxed);
+	if (swarm) {
+		interval *= swarm->interval_stretch();
+	}
+	interval *= std::uniform_real_distribution<double>(1 - INTERVAL_JITTER, 1 + INTERVAL_JITTER)(rng);
+	return std::clamp(static_cast<int>(std::lround(interval)), 1, MAX_ANNOUNCE_INTERVAL);
 }
 
-void Tracker::cleanup_inactive_peers()
+Swarm *Tracker::record_announce(Shard &shard, const Id20 &info_hash, PeerRecord peer,
+								std::mt19937 &rng, int &interval)
 {
-    time_t current_time = time(nullptr);
+	const Swarm *existing = shard.torrents.find(info_hash);
+	interval = interval_for(existing, rng);
 
-    for (auto &[info_hash, peer_list] : torrents) {
-        peer_list.erase(
-            std::remove_if(peer_list.begin(), peer_list.end(),
-                [this, current_time](const PeerInfo &peer) {
-                    return (current_time - peer.last_announce) > peer_timeout;
-                }),
-            peer_list.end()
-        );
-    }
+	/* The timeout keeps its ratio to whatever interval this peer was told */
+	time_t timeout = static_cast<time_t>(interval) * peer_timeout / announce_interval;
+	peer.valid_until = static_cast<uint32_t>(time(nullptr) + timeout);
+	shard.announces++;
+	if (journaling) {
+		shard.journal.push_back({info_hash, peer});
+	}
+	Swarm *swarm = update_swarm(shard, info_hash, peer);
+	if (swarm) {
+		swarm->count_announce();
+	}
+	return swarm;
+}
+
+static std::mt19937 &thread_rng()
+{
+	thread_local std::mt19937 rng(std::random_device{}());
+	return rng;
+}
+
+static int clamp_numwant(int numwant)
+{
+	if (numwant < 0) {
+		numwant = DEFAULT_NUMWANT;
+	}
+	return std::min(numwant, MAX_NUMWANT);
+}
+
+void Tracker::handle_announce(const Id20 &info_hash, const PeerRecord &peer,
+							  bool compact, int numwant, std::string &out)
+{
+	Shard &shard = shard_for(info_hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::mt19937 &rng = thread_rng();
+	int interval;
+	Swarm *swarm = record_announce(shard, info_hash, peer, rng, interval);
+	generate_response(swarm, peer, compact, numwant, interval, rng, out);
 }
 
-void Tracker::update_peer(const std::string &info_hash, const PeerInfo &peer)
+static void append_u32(std::string &out, uint32_t value)
 {
-	auto &peer_list = torrents[info_hash];
+	char buf[4];
+	boost::endian::store_big_u32(reinterpret_cast<unsigned char*>(buf), value);
+	out.append(buf, sizeof(buf));
+}
+
+void Tracker::handle_udp_announce(const Id20 &info_hash, const PeerRecord &peer,
+								  int numwant, std::string &out)
+{
+	Shard &shard = shard_for(info_hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::mt19937 &rng = thread_rng();
+	int interval;
+	Swarm *swarm = record_announce(shard, info_hash, peer, rng, interval);
+
+	append_u32(out, interval);
+	append_u32(out, swarm ? swarm->leechers() : 0);
+	append_u32(out, swarm ? swarm->seeders() : 0);
+	if (swarm) {
+		swarm->append_compact(clamp_numwant(numwant), peer, locality, rng, out);
+	}
+}
+
+ScrapeStats Tracker::scrape(const Id20 &info_hash) const
+{
+	Shard &shard = shard_for(info_hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	ScrapeStats stats;
+	if (const Swarm *swarm = shard.torrents.find(info_hash)) {
+		stats.complete = swarm->seeders();
+		stats.downloaded = swarm->downloaded();
+		stats.incomplete = swarm->leechers();
+	} else if (RetiredSwarm *retired = shard.retired_downloads.find(info_hash)) {
+		stats.downloaded = retired->downloaded;
+		retired->touched = static_cast<uint32_t>(time(nullptr));
+	}
+	return stats;
+}
 
-	bool exists = false;
-	for (auto &existing_peer : peer_list) {
-		if (peer.peer_id != existing_peer.peer_id) {
+void Tracker::handle_scrape(std::vector<Id20> &info_hashes, std::string &out) const
+{
+	/* Bencode orders keys as raw (unsigned) bytes, which char comparison wouldn't */
+	std::sort(info_hashes.begin(), info_hashes.end(), [](const Id20 &a, const Id20 &b) {
+		return std::memcmp(a.data(), b.data(), a.size()) < 0;
+	});
+	info_hashes.erase(std::unique(info_hashes.begin(), info_hashes.end()), info_hashes.end());
+
+	out += "d5:filesd";
+	for (const Id20 &info_hash : info_hashes) {
+		ScrapeStats stats = scrape(info_hash);
+		append_bencode_string(out, std::string_view(info_hash.data(), info_hash.size()));
+		out += "d8:complete";
+		append_bencode_int(out, stats.complete);
+		out += "10:downloaded";
+		append_bencode_int(out, stats.downloaded);
+		out += "10:incomplete";
+		append_bencode_int(out, stats.incomplete);
+		out += 'e';
+	}
+	out += "ee";
+}
+
+/*
+ * Written straight into the caller's buffer; the peer entries themselves
+ * are copied from the swarm's binary records or its dict cache.
+ */
+void Tracker::generate_response(const Swarm *swarm, const PeerRecord &caller, bool compact,
+								int numwant, int interval, std::mt19937 &rng, std::string &out)
+{
+	/* min interval: how soon the client may announce again outside the schedule */
+	out += "d8:interval";
+	append_bencode_int(out, interval);
+	out += "12:min interval";
+	append_bencode_int(out, std::max(1, interval / 2));
+
+	if (!swarm) {
+		out += compact ? "5:peers0:e" : "5:peerslee";
+		return;
+	}
+
+	/*
+	 * A random rotation, or a random subset ranked by locality and seed
+	 * status, so clients don't all dial the same peers in the same order
+	 */
+	swarm->append_peers(compact, clamp_numwant(numwant), caller, locality, rng, out);
+	out += 'e';
+}
+
+void Tracker::drain_journal(std::vector<JournalEntry> &out)
+{
+	for (auto &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		out.insert(out.end(), shard->journal.begin(), shard->journal.end());
+		shard->journal.clear();
+	}
+}
+
+size_t Tracker::restore_swarm(const Id20 &info_hash, uint32_t downloaded,
+							  const PeerRecord *peers, size_t count)
+{
+	Shard &shard = shard_for(info_hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	time_t now = time(nullptr);
+
+	Swarm *swarm = shard.torrents.insert(info_hash).first;
+	swarm->reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		if (peers[i].valid_until < now || !swarm->upsert(peers[i])) {
 			continue;
 		}
-		existing_peer.ip = peer.ip;
-		existing_peer.port = peer.port;
-		existing_peer.status = peer.status;
-		existing_peer.last_announce = time(nullptr);
-		exists = true;
-		break;
+		shard.num_peers++;
+		PeerRecord *record = swarm->find(peers[i].peer_id);
+		record->expires = static_cast<uint32_t>(
+			shard.expiry.schedule(record->valid_until + 1, info_hash, record->peer_id));
+	}
+
+	/* upsert() counted completed events again; the saved total is the real one */
+	swarm->set_downloaded(downloaded);
+	size_t restored = swarm->size();
+	if (swarm->empty()) {
+		erase_swarm(shard, info_hash);
+	}
+	return restored;
+}
+
+void Tracker::replay_announce(const JournalEntry &entry)
+{
+	Shard &shard = shard_for(entry.info_hash);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	update_swarm(shard, entry.info_hash, entry.peer);
+
+	/*
+	 * Timed out since: the announce still counts (a completed download
+	 * stays counted), but the peer is dropped as restore_swarm() would,
+	 * along with any older record of it from the snapshot
+	 */
+	if (entry.peer.event != EVENT_STOPPED && entry.peer.valid_until < time(nullptr)) {
+		PeerRecord gone = entry.peer;
+		gone.event = EVENT_STOPPED;
+		update_swarm(shard, entry.info_hash, gone);
 	}
+}
 
-	if (!exists) {
-		peer_list.push_back(peer);
+TrackerTotals Tracker::totals() const
+{
+	TrackerTotals totals;
+	for (auto &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		totals.torrents += shard->torrents.size();
+		totals.peers += shard->num_peers;
+		shard->torrents.for_each([&](const Id20 &, const Swarm &swarm) {
+			totals.seeders += swarm.seeders();
+		});
 	}
+	return totals;
 }
 
-int Tracker::get_peer_count(const std::string &info_hash) const
+/*
+ * One shard at a time, so announces elsewhere keep flowing during the
+ * sweep. Every RETIRED_SWEEP_INTERVAL the same pass also drops download
+ * counts nobody has scraped for RETIRED_SWARM_TTL, so torrents that come
+ * and go don't pile up in retired_downloads forever.
+ */
+size_t Tracker::expire_peers()
 {
-	auto it = torrents.find(info_hash);
-	if (it == torrents.end()) {
-		return -1;
+	time_t now = time(nullptr);
+	size_t expired = 0;
+	bool sweep_retired = now >= next_retired_sweep;
+	if (sweep_retired) {
+		next_retired_sweep = now + RETIRED_SWEEP_INTERVAL;
 	}
-	return it->second.size();
+	std::vector<Id20> stale;
+
+	for (auto &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		if (sweep_retired) {
+			stale.clear();
+			shard->retired_downloads.for_each([&](const Id20 &info_hash, const RetiredSwarm &retired) {
+				if (now - static_cast<time_t>(retired.touched) > RETIRED_SWARM_TTL) {
+					stale.push_back(info_hash);
+				}
+			});
+			for (const Id20 &info_hash : stale) {
+				shard->retired_downloads.erase(info_hash);
+			}
+		}
+		shard->expiry.advance(now, [&](const ExpiryWheel::Entry &entry) -> time_t {
+			Swarm *swarm = shard->torrents.find(entry.info_hash);
+			if (!swarm) {
+				return 0;
+			}
+			/* Gone, or a leftover entry from before the peer stopped and rejoined */
+			PeerRecord *peer = swarm->find(entry.peer_id);
+			if (!peer || peer->expires != entry.deadline) {
+				return 0;
+			}
+			if (peer->valid_until >= now) {
+				peer->expires = peer->valid_until + 1;
+				return peer->expires;
+			}
+
+			swarm->remove(entry.peer_id);
+			shard->num_peers--;
+			expired++;
+			if (swarm->empty()) {
+				erase_swarm(*shard, entry.info_hash);
+			}
+			return 0;
+		});
+	}
+	return expired;
+}
+
+/*
+ * A swarm's load is the announces it makes per shared interval, i.e. its
+ * measured rate scaled back up by the intervals it was already given.
+ * For peers that keep to their interval that is the swarm size; clients
+ * that re-announce early push it higher. Past a full peer list (where
+ * every announce already returns MAX_NUMWANT fresh peers) the torrent's
+ * interval grows with the square root of the excess, up to
+ * BUSY_SWARM_STRETCH.
+ */
+static double swarm_stretch(const Swarm &swarm, double shared_interval)
+{
+	double load = swarm.announce_rate() * shared_interval * swarm.interval_stretch();
+	return std::clamp(std::sqrt(load / MAX_NUMWANT), 1.0, BUSY_SWARM_STRETCH);
+}
+
+void Tracker::update_load(double seconds, double cpu_load)
+{
+	size_t peers = 0;
+	uint64_t announces = 0;
+	double shared_interval = scaled_interval.load(std::memory_order_relaxed);
+	for (auto &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		peers += shard->num_peers;
+		announces += shard->announces;
+		shard->announces = 0;
+		shard->torrents.for_each([&](const Id20 &, Swarm &swarm) {
+			swarm.tick_rate(seconds);
+			swarm.set_interval_stretch(swarm_stretch(swarm, shared_interval));
+		});
+	}
+	if (seconds > 0) {
+		announce_rate += 0.2 * (announces / seconds - announce_rate);
+	}
+
+	/*
+	 * The rate the current peers would announce at with the base interval:
+	 * counted from the peer table, or from the measured rate scaled back up
+	 * by the stretch already applied, whichever is higher.
+	 */
+	double demand = std::max(static_cast<double>(peers) / announce_interval, announce_rate * load_factor);
+	double rate_factor = std::max(1.0, demand / target_rate);
+
+	/* CPU is the backstop for whatever the rate target misjudged: push up while over, ease off after */
+	if (cpu_load > TARGET_CPU_LOAD) {
+		cpu_factor *= cpu_load / TARGET_CPU_LOAD;
+	} else {
+		cpu_factor = std::max(1.0, cpu_factor * 0.98);
+	}
+	double max_factor = static_cast<double>(MAX_ANNOUNCE_INTERVAL) / announce_interval;
+	cpu_factor = std::min(cpu_factor, max_factor);
+
+	load_factor = std::clamp(rate_factor * cpu_factor, 1.0, std::max(1.0, max_factor));
+	scaled_interval.store(static_cast<int>(std::lround(announce_interval * load_factor)),
+						  std::memory_order_relaxed);
 }
@@ -0,0 +1,743 @@
+#include <tracker_client.hpp>
+#include <bencode.hpp>
+#include <http_parser.hpp>
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+#define HTTP_READ_CHUNK 16384
+
+/* BEP 23 compact peers: address bytes then a big-endian port, back to back */
+static void parse_compact_peers(std::string_view blob, bool ipv6, std::vector<PeerInfo> &peer_list)
+{
+	size_t addr_size = ipv6 ? 16 : 4;
+	size_t entry_size = addr_size + 2;
+
+	for (size_t off = 0; off + entry_size <= blob.size(); off += entry_size) {
+		const unsigned char *entry = reinterpret_cast<const unsigned char*>(blob.data() + off);
+		std::string ip;
+		if (ipv6) {
+			boost::asio::ip::address_v6::bytes_type bytes;
+			memcpy(bytes.data(), entry, bytes.size());
+			ip = boost::asio::ip::address_v6(bytes).to_string();
+		} else {
+			boost::asio::ip::address_v4::bytes_type bytes;
+			memcpy(bytes.data(), entry, bytes.size());
+			ip = boost::asio::ip::address_v4(bytes).to_string();
+		}
+		uint16_t port = (entry[addr_size] << 8) | entry[addr_size + 1];
+		peer_list.emplace_back("", ip, port);
+	}
+}
+
+tracker_resp parse_tracker_response(std::string_view body)
+{
+	tracker_resp resp;
+
+	auto data = bencode::decode_view(body);
+	auto root_dict = std::get<bencode::dict_view>(data);
+
+	if (root_dict.count("failure reason")) {
+		throw std::runtime_error("tracker failure: " +
+			std::string(std::get<bencode::string_view>(root_dict["failure reason"])));
+	}
+
+	if (root_dict.count("interval")) {
+		resp.interval = std::get<bencode::integer_view>(root_dict["interval"]);
+	} else {
+		throw std::runtime_error("No interval provided from tracker");
+	}
+	if (root_dict.count("min interval")) {
+		resp.min_interval = std::get<bencode::integer_view>(root_dict["min interval"]);
+	}
+
+	if (!root_dict.count("peers")) {
+		throw std::runtime_error("No peers list provided from tracker");
+	}
+
+	auto &peers = root_dict["peers"];
+	if (auto compact = std::get_if<bencode::string_view>(&peers.base())) {
+		parse_compact_peers(*compact, false, resp.peer_list);
+	} else {
+		for (auto &one_data : std::get<bencode::list_view>(peers)) {
+			auto peer_dict = std::get<bencode::dict_view>(one_data);
+			auto peer_id = std::get<bencode::string_view>(peer_dict["peer id"]);
+			auto peer_ip = std::get<bencode::string_view>(peer_dict["ip"]);
+			auto peer_port = std::get<bencode::integer_view>(peer_dict["port"]);
+			resp.peer_list.emplace_back(std::string(peer_id), std::string(peer_ip), peer_port);
+		}
+	}
+
+	if (root_dict.count("peers6")) {
+		parse_compact_peers(std::get<bencode::string_view>(root_dict["peers6"]), true, resp.peer_list);
+	}
+
+	return resp;
+}
+
+/* HTTP/1.1, so the connection stays open for the next announce */
+static std::string build_http_get_request(const std::string &announce_request,
+										  const std::string &host,
+										  const std::string &port)
+{
+	std::string req = "GET " + announce_request + " HTTP/1.1\r\n";
+	req += "Host: " + host;
+	if (port != "80") req += ":" + port;
+	req += "\r\n";
+	req += "User-Agent: MyClient/1.0\r\n";
+	req += "\r\n";
+	return req;
+}
+
+TrackerConnection::TrackerConnection(boost::asio::io_context &io, const std::string &announce)
+	: announce_url(announce),
+	  url(parse_url(announce)),
+	  resolver(io),
+	  deadline(io),
+	  tcp_socket(io),
+	  udp_socket(io),
+	  rng(std::random_device{}())
+{
+}
+
+void TrackerConnection::announce(const AnnounceParams &announce, Handler done)
+{
+	params = announce;
+	handler = std::move(done);
+	timed_out = false;
+	cancelled = false;
+
+	arm_deadline(TRACKER_TIMEOUT);
+	resolve([this]() {
+		if (url.scheme == "udp") {
+			udp_announce();
+		} else {
+			http_announce();
+		}
+	});
+}
+
+void TrackerConnection::cancel()
+{
+	if (!handler) {
+		return;
+	}
+	cancelled = true;
+	boost::system::error_code ignored;
+	resolver.cancel();
+	tcp_socket.close(ignored);
+	udp_socket.cancel(ignored);
+}
+
+/* Pending operations fail with operation_aborted when it fires */
+void TrackerConnection::arm_deadline(int seconds)
+{
+	deadline.expires_after(std::chrono::seconds(seconds));
+	auto self = shared_from_this();
+	deadline.async_wait([this, self](const boost::system::error_code &ec) {
+		/* Re-armed or finished since this wait was queued */
+		if (ec || !handler || deadline.expiry() > std::chrono::steady_clock::now()) {
+			return;
+		}
+		timed_out = true;
+		boost::system::error_code ignored;
+		resolver.cancel();
+		tcp_socket.close(ignored);
+		udp_socket.cancel(ignored);
+	});
+}
+
+std::string TrackerConnection::error_text(const boost::system::error_code &ec, const std::string &doing) const
+{
+	if (cancelled) {
+		return "cancelled";
+	}
+	if (timed_out) {
+		return "timed out " + doing;
+	}
+	return doing + ": " + ec.message();
+}
+
+void TrackerConnection::resolve(std::function<void()> next)
+{
+	if (!endpoints.empty() && std::chrono::steady_clock::now() < resolved_until) {
+		next();
+		return;
+	}
+
+	auto self = shared_from_this();
+	resolver.async_resolve(url.host, url.port,
+		[this, self, next](const boost::system::error_code &ec, tcp::resolver::results_type results) {
+			if (ec || results.empty()) {
+				fail(error_text(ec, "resolving " + url.host));
+				return;
+			}
+			endpoints.clear();
+			for (const auto &entry : results) {
+				endpoints.push_back(entry.endpoint());
+			}
+			resolved_until = std::chrono::steady_clock::now() + std::chrono::seconds(TRACKER_RESOLVE_TTL);
+			next();
+		});
+}
+
+void TrackerConnection::fail(const std::string &error)
+{
+	finish(error, tracker_resp());
+}
+
+/* Posted, so a failure found before any I/O doesn't call back into the caller's announce() */
+void TrackerConnection::finish(const std::string &error, tracker_resp resp)
+{
+	deadline.cancel();
+	Handler done = std::move(handler);
+	handler = nullptr;
+	if (done) {
+		boost::asio::post(deadline.get_executor(),
+			[done = std::move(done), error, resp = std::move(resp)]() mutable {
+				done(error, std::move(resp));
+			});
+	}
+}
+
+void TrackerConnection::http_announce()
+{
+	std::string target = build_announce_request(announce_url, params.info_hash, params.peer_id,
+												params.port, params.uploaded, params.downloaded,
+												params.left, params.event);
+	request = build_http_get_request(target, url.host, url.port);
+	response.clear();
+
+	reusing = tcp_socket.is_open();
+	if (reusing) {
+		http_write();
+	} else {
+		http_connect();
+	}
+}
+
+void TrackerConnection::http_connect()
+{
+	auto self = shared_from_this();
+	boost::asio::async_connect(tcp_socket, endpoints,
+		[this, self](const boost::system::error_code &ec, const tcp::endpoint &) {
+			if (ec) {
+				/* The address may have moved, look it up again next time */
+				endpoints.clear();
+				fail(error_text(ec, "connecting to " + url.host));
+				return;
+			}
+			http_write();
+		});
+}
+
+void TrackerConnection::http_write()
+{
+	auto self = shared_from_this();
+	boost::asio::async_write(tcp_socket, boost::asio::buffer(request),
+		[this, self](const boost::system::error_code &ec, size_t) {
+			if (ec && reusing && !timed_out && !cancelled) {
+				/* Closed by the tracker while we were idle, not a failure */
+				boost::system::error_code ignored;
+				tcp_socket.close(ignored);
+				reusing = false;
+				http_connect();
+				return;
+			}
+			if (ec) {
+				boost::system::error_code ignored;
+				tcp_socket.close(ignored);
+				fail(error_text(ec, "writing to " + url.host));
+				return;
+			}
+			http_read();
+		});
+}
+
+void TrackerConnection::http_read()
+{
+	size_t have = response.size();
+	response.resize(have + HTTP_READ_CHUNK);
+
+	auto self = shared_from_this();
+	tcp_socket.async_read_some(boost::asio::buffer(&response[have], HTTP_READ_CHUNK),
+		[this, self, have](const boost::system::error_code &ec, size_t n) {
+			response.resize(have + n);
+			boost::system::error_code ignored;
+			if (ec && reusing && response.empty() && !timed_out && !cancelled) {
+				tcp_socket.close(ignored);
+				reusing = false;
+				http_connect();
+				return;
+			}
+			if (ec) {
+				tcp_socket.close(ignored);
+				fail(error_text(ec, "reading from " + url.host));
+				return;
+			}
+
+			std::string_view body;
+			size_t consumed;
+			switch (parse_http_response(response.data(), response.size(), body, consumed)) {
+			case HTTP_PARSE_INCOMPLETE:
+				if (response.size() > TRACKER_MAX_RESPONSE) {
+					tcp_socket.close(ignored);
+					fail("response from " + url.host + " too large");
+					return;
+				}
+				http_read();
+				return;
+			case HTTP_PARSE_ERROR:
+				tcp_socket.close(ignored);
+				fail("bad HTTP response from " + url.host);
+				return;
+			case HTTP_PARSE_OK:
+				break;
+			}
+
+			tracker_resp resp;
+			try {
+				resp = parse_tracker_response(body);
+			} catch (const std::exception &e) {
+				fail(e.what());
+				return;
+			}
+			finish("", std::move(resp));
+		});
+}
+
+void TrackerConnection::udp_announce()
+{
+	udp::endpoint target(endpoints.front().address(), endpoints.front().port());
+
+	/* Connection ids are tied to our address and port, so a new socket needs a new id */
+	boost::system::error_code ec;
+	if (!udp_socket.is_open() || udp_socket.remote_endpoint(ec) != target) {
+		udp_socket.close(ec);
+		udp_socket.open(target.protocol(), ec);
+		if (!ec) {
+			udp_socket.connect(target, ec);
+		}
+		if (ec) {
+			fail("udp socket for " + url.host + ": " + ec.message());
+			return;
+		}
+		connection_until = {};
+	}
+
+	if (std::chrono::steady_clock::now() < connection_until) {
+		udp_send_announce(true);
+	} else {
+		udp_send_connect();
+	}
+}
+
+void TrackerConnection::udp_send_connect()
+{
+	transaction_id = rng();
+	boost::endian::store_big_u64(packet.data(), UDP_PROTOCOL_ID);
+	boost::endian::store_big_u32(packet.data() + 8, UDP_ACTION_CONNECT);
+	boost::endian::store_big_u32(packet.data() + 12, transaction_id);
+
+	udp_transact(16, 0, [this](const std::string &error, size_t n) {
+		if (!error.empty()) {
+			fail(error);
+			return;
+		}
+		if (n < 16) {
+			fail("short udp connect response");
+			return;
+		}
+		connection_id = boost::endian::load_big_u64(reply.data() + 8);
+		connection_until = std::chrono::steady_clock::now() + std::chrono::seconds(UDP_CONNECTION_TTL);
+		udp_send_announce(false);
+	});
+}
+
+void TrackerConnection::udp_send_announce(bool cached)
+{
+	uint32_t event_code = UDP_EVENT_NONE;
+	if (params.event == "completed") event_code = UDP_EVENT_COMPLETED;
+	else if (params.event == "started") event_code = UDP_EVENT_STARTED;
+	else if (params.event == "stopped") event_code = UDP_EVENT_STOPPED;
+
+	unsigned char *request = packet.data();
+	transaction_id = rng();
+	boost::endian::store_big_u64(request, connection_id);
+	boost::endian::store_big_u32(request + 8, UDP_ACTION_ANNOUNCE);
+	boost::endian::store_big_u32(request + 12, transaction_id);
+	memcpy(request + 16, params.info_hash.data(), 20);
+	memcpy(request + 36, params.peer_id.data(), 20);
+	boost::endian::store_big_u64(request + 56, params.downloaded);
+	boost::endian::store_big_u64(request + 64, params.left);
+	boost::endian::store_big_u64(request + 72, params.uploaded);
+	boost::endian::store_big_u32(request + 80, event_code);
+	boost::endian::store_big_u32(request + 84, 0);   /* ip: use the sender address */
+	boost::endian::store_big_u32(request + 88, rng()); /* key */
+	boost::endian::store_big_u32(request + 92, static_cast<uint32_t>(-1)); /* num_want: default */
+	boost::endian::store_big_u16(request + 96, params.port);
+
+	udp_transact(98, 0, [this, cached](const std::string &error, size_t n) {
+		if (!error.empty() && cached && n > 0) {
+			/* A cached id is refused if the tracker restarted, so try a fresh one */
+			connection_until = {};
+			udp_send_connect();
+			return;
+		}
+		if (!error.empty()) {
+			fail(error);
+			return;
+		}
+		if (n < 20) {
+			fail("short udp announce response");
+			return;
+		}
+
+		tracker_resp resp;
+		resp.interval = boost::endian::load_big_u32(reply.data() + 8);
+		std::string_view peers(reinterpret_cast<const char*>(reply.data() + 20), n - 20);
+		parse_compact_peers(peers, endpoints.front().address().is_v6(), resp.peer_list);
+		finish("", std::move(resp));
+	});
+}
+
+/*
+ * Send the len bytes in packet and wait for the reply carrying the same
+ * transaction id, retransmitting on timeout (BEP 15).
+ */
+void TrackerConnection::udp_transact(size_t len, int attempt, UdpHandler on_reply)
+{
+	timed_out = false;
+	arm_deadline(TRACKER_TIMEOUT << attempt);
+
+	auto self = shared_from_this();
+	udp_socket.async_send(boost::asio::buffer(packet.data(), len),
+		[this, self, len, attempt, on_reply](const boost::system::error_code &ec, size_t) {
+			if (ec) {
+				on_reply(error_text(ec, "sending to " + url.host), 0);
+				return;
+			}
+			udp_receive(len, attempt, on_reply);
+		});
+}
+
+void TrackerConnection::udp_receive(size_t len, int attempt, UdpHandler on_reply)
+{
+	auto self = shared_from_this();
+	udp_socket.async_receive(boost::asio::buffer(reply),
+		[this, self, len, attempt, on_reply](const boost::system::error_code &ec, size_t n) {
+			if (ec && timed_out && !cancelled) {
+				if (attempt + 1 < TRACKER_UDP_RETRIES) {
+					udp_transact(len, attempt + 1, on_reply);
+					return;
+				}
+				/* Gone quiet; look the address up again next time */
+				endpoints.clear();
+				connection_until = {};
+				on_reply("timed out waiting for " + url.host, 0);
+				return;
+			}
+			if (ec) {
+				on_reply(error_text(ec, "receiving from " + url.host), 0);
+				return;
+			}
+			if (n < 8 || boost::endian::load_big_u32(reply.data() + 4) != transaction_id) {
+				udp_receive(len, attempt, on_reply); /* stale reply to an earlier try */
+				return;
+			}
+			if (boost::endian::load_big_u32(reply.data()) == UDP_ACTION_ERROR) {
+				on_reply("tracker failure: " +
+					std::string(reinterpret_cast<const char*>(reply.data() + 8), n - 8), n);
+				return;
+			}
+			on_reply("", n);
+		});
+}
+
+/*
+ * All of a tier is announced to at once, so BEP 12's shuffling and
+ * moving the tracker that answered to the front have nothing to decide.
+ */
+TrackerClient::TrackerClient(const std::vector<std::vector<std::string>> &announce_tiers,
+							 TorrentState &torrent_state, const std::string &our_id,
+							 uint16_t our_port, PeersHandler handler)
+	: work(boost::asio::make_work_guard(io)),
+	  timer(io),
+	  failover_timer(io),
+	  state(torrent_state),
+	  info_hash(torrent_state.get_metadata().info_hash),
+	  peer_id(our_id),
+	  port(our_port),
+	  on_peers(std::move(handler)),
+	  rng(std::random_device{}())
+{
+	for (const auto &urls : announce_tiers) {
+		std::vector<std::shared_ptr<TrackerEntry>> tier;
+		for (const std::string &announce_url : urls) {
+			std::string scheme = parse_url(announce_url).scheme;
+			if (scheme != "http" && scheme != "udp") {
+				std::cerr << "skipping tracker " << announce_url << ": " << scheme
+						  << " is not supported" << std::endl;
+				continue;
+			}
+			auto entry = std::make_shared<TrackerEntry>();
+			entry->connection = std::make_shared<TrackerConnection>(io, announce_url);
+			tier.push_back(entry);
+		}
+		if (!tier.empty()) {
+			tiers.push_back(std::move(tier));
+		}
+	}
+	if (tiers.empty()) {
+		throw std::runtime_error("no usable tracker URL in torrent");
+	}
+}
+
+TrackerClient::~TrackerClient()
+{
+	if (worker.joinable()) {
+		io.stop();
+		worker.join();
+	}
+}
+
+void TrackerClient::start()
+{
+	worker = std::thread([this]() { io.run(); });
+	boost::asio::post(io, [this]() { announce_now(); });
+}
+
+void TrackerClient::completed()
+{
+	boost::asio::post(io, [this]() {
+		/* Until "started" is in, a plain start with left=0 says the same */
+		for (const auto &tier : tiers) {
+			for (const auto &entry : tier) {
+				if (entry->pending_event != "started") {
+					entry->pending_event = "completed";
+				}
+			}
+		}
+		announce_now();
+	});
+}
+
+void TrackerClient::stop()
+{
+	if (!worker.joinable()) {
+		return;
+	}
+	boost::asio::post(io, [this]() {
+		stopping = true;
+		timer.cancel();
+		failover_timer.cancel();
+		if (outstanding == 0) {
+			send_stopped();
+			return;
+		}
+		/* handle_response sends the stops once these are back */
+		for (const auto &tier : tiers) {
+			for (const auto &entry : tier) {
+				if (entry->in_flight) {
+					entry->connection->cancel();
+				}
+			}
+		}
+	});
+	worker.join();
+}
+
+/* Counters are sampled once per round, so every tracker hears the same numbers */
+AnnounceParams TrackerClient::make_params()
+{
+	AnnounceParams params;
+	params.info_hash = info_hash;
+	params.peer_id = peer_id;
+	params.port = port;
+	params.uploaded = state.uploaded();
+	params.downloaded = state.downloaded();
+	params.left = state.bytes_left();
+	return params;
+}
+
+void TrackerClient::announce_now()
+{
+	if (stopping) {
+		return;
+	}
+	if (round_active) {
+		again = true;
+		return;
+	}
+	timer.cancel();
+	round_active = true;
+	again = false;
+	answered = false;
+	tiers_started = 0;
+	round_peers.clear();
+	start_tier(0);
+}
+
+void TrackerClient::start_tier(size_t t)
+{
+	tiers_started = t + 1;
+	AnnounceParams params = make_params();
+	for (const auto &entry : tiers[t]) {
+		params.event = entry->pending_event;
+		entry->in_flight = true;
+		outstanding++;
+		entry->connection->announce(params,
+			[this, t, entry, event = params.event](const std::string &error, tracker_resp resp) {
+				handle_response(t, entry, event, error, std::move(resp));
+			});
+	}
+
+	if (t + 1 < tiers.size()) {
+		failover_timer.expires_after(std::chrono::seconds(TRACKER_FAILOVER_TIMEOUT));
+		failover_timer.async_wait([this, t](const boost::system::error_code &ec) {
+			if (!ec && round_active && !answered && tiers_started == t + 1) {
+				std::cerr << "no answer from tier " << t + 1 << " yet, trying tier " << t + 2 << std::endl;
+				start_tier(t + 1);
+			}
+		});
+	}
+}
+
+void TrackerClient::handle_response(size_t t, const std::shared_ptr<TrackerEntry> &entry,
+									const std::string &event, const std::string &error,
+									tracker_resp resp)
+{
+	entry->in_flight = false;
+	outstanding--;
+	if (stopping) {
+		if (outstanding == 0) {
+			send_stopped();
+		}
+		return;
+	}
+
+	if (error.empty()) {
+		if (event == entry->pending_event) {
+			entry->pending_event.clear();
+		}
+		if (!answered) {
+			answered = true;
+			min_interval = resp.min_interval;
+			long long interval = std::max({resp.interval, resp.min_interval,
+										   static_cast<long long>(TRACKER_RETRY_MIN)});
+			next_round = std::chrono::steady_clock::now() + std::chrono::seconds(interval);
+		} else {
+			min_interval = std::max(min_interval, resp.min_interval);
+		}
+
+		std::vector<PeerInfo> fresh;
+		for (const PeerInfo &peer : resp.peer_list) {
+			if (round_peers.insert(peer.ip + ":" + std::to_string(peer.port)).second) {
+				fresh.push_back(peer);
+			}
+		}
+		std::cout << "announced" << (event.empty() ? "" : " " + event) << " to "
+				  << entry->connection->get_url() << ": " << resp.peer_list.size() << " peers ("
+				  << fresh.size() << " new)" << std::endl;
+		if (on_peers && !fresh.empty()) {
+			on_peers(fresh);
+		}
+	} else {
+		std::cerr << "announce to " << entry->connection->get_url() << " failed: " << error << std::endl;
+	}
+
+	/* The newest tier has all failed: fail over now rather than at the timeout */
+	if (!answered && t + 1 == tiers_started && tiers_started < tiers.size() &&
+		std::none_of(tiers[t].begin(), tiers[t].end(), [](const auto &e) { return e->in_flight; })) {
+		failover_timer.cancel();
+		start_tier(t + 1);
+	}
+
+	if (outstanding == 0) {
+		end_round();
+	}
+}
+
+void TrackerClient::end_round()
+{
+	round_active = false;
+	failover_timer.cancel();
+
+	if (answered) {
+		failures = 0;
+		if (again) {
+			announce_now();
+			return;
+		}
+		long long wait = std::chrono::ceil<std::chrono::seconds>(next_round - std::chrono::steady_clock::now()).count();
+		std::cout << "next announce in " << std::max(wait, 0LL) << " seconds" << std::endl;
+		schedule(next_round);
+		return;
+	}
+
+	/* Doubling with +-25% jitter, so a tracker coming back isn't hit by everyone at once */
+	failures++;
+	long long wait = std::min<long long>(static_cast<long long>(TRACKER_RETRY_MIN) << std::min(failures - 1, 20),
+										 TRACKER_RETRY_MAX);
+	wait = std::uniform_int_distribution<long long>(wait * 3 / 4, wait * 5 / 4)(rng);
+	wait = std::max(wait, min_interval);
+	std::cerr << "no tracker answered, retrying in " << wait << " seconds" << std::endl;
+	schedule(std::chrono::steady_clock::now() + std::chrono::seconds(wait));
+}
+
+void TrackerClient::schedule(std::chrono::steady_clock::time_point when)
+{
+	timer.expires_at(when);
+	timer.async_wait([this](const boost::system::error_code &ec) {
+		if (!ec) {
+			announce_now();
+		}
+	});
+}
+
+/* Only trackers that have us need telling, and all of them are told at once */
+void TrackerClient::send_stopped()
+{
+	auto done = [this]() {
+		work.reset();
+		io.stop();
+	};
+
+	AnnounceParams params = make_params();
+	params.event = "stopped";
+	for (const auto &tier : tiers) {
+		for (const auto &entry : tier) {
+			if (entry->pending_event == "started") {
+				continue;
+			}
+			outstanding++;
+			entry->connection->announce(params, [this, entry, done](const std::string &error, tracker_resp) {
+				if (error.empty()) {
+					std::cout << "notified " << entry->connection->get_url() << " of shutdown" << std::endl;
+				} else {
+					std::cerr << "failed to notify " << entry->connection->get_url() << ": " << error << std::endl;
+				}
+				if (--outstanding == 0) {
+					done();
+				}
+			});
+		}
+	}
+	if (outstanding == 0) {
+		done();
+		return;
+	}
+
+	timer.expires_after(std::chrono::seconds(TRACKER_STOP_TIMEOUT));
+	timer.async_wait([this, done](const boost::system::error_code &ec) {
+		if (!ec) {
+			std::cerr << "failed to notify " << outstanding << " tracker(s): timed out" << std::endl;
+			done();
+		}
+	});
+}
@@ -0,0 +1,447 @@
+#include <http_parser.hpp>
+#include <utils.hpp>
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using boost::asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+#define LOADGEN_TIMEOUT 5 /* seconds before an unanswered announce counts as an error */
+#define LOADGEN_MIN_WAIT_US 100 /* shortest scheduler sleep; announces due sooner go out together */
+#define LOADGEN_FILE_SIZE (1LL << 30) /* "left" at started, counting down while leeching */
+#define LOADGEN_MAX_PERIODIC 4 /* regular announces per client while leeching, and again while seeding */
+
+enum LoadEvent {
+	LOAD_STARTED,
+	LOAD_PERIODIC,
+	LOAD_COMPLETED,
+	LOAD_STOPPED,
+	NUM_LOAD_EVENTS
+};
+
+static const char *EVENT_NAMES[NUM_LOAD_EVENTS] = {"started", "periodic", "completed", "stopped"};
+
+/*
+ * One simulated peer in one torrent. Every announce moves it one step
+ * along started, a few periodic announces while leeching, completed, a
+ * few more as a seed and stopped; after that it rejoins under a new
+ * peer_id, so swarms keep turning over the way real ones do.
+ */
+struct SimClient {
+	string info_hash; /* url-encoded */
+	string peer_id;   /* url-encoded */
+	uint16_t port = 0;
+	int step = 0;
+	int leech_steps = 0;
+	int seed_steps = 0;
+};
+
+struct LoadOptions {
+	string host = "127.0.0.1";
+	string port = "8080";
+	size_t clients = 1000;
+	size_t torrents = 100;
+	double rate = 10000;
+	int duration = 10;
+	size_t connections = 32;
+	int numwant = 50;
+};
+
+class LoadGenerator;
+
+/* A keep-alive connection carrying one announce at a time */
+class LoadConnection {
+private:
+	LoadGenerator &gen;
+	tcp::socket socket;
+	boost::asio::steady_timer retry;
+	array<char, 16384> chunk;
+	string received;
+	string request;
+
+	void do_read();
+	void fail(size_t LoadGenerator::*counter);
+
+public:
+	bool ready = false; /* connected and idle */
+	bool busy = false;
+	Clock::time_point scheduled; /* when the announce in flight was due */
+	Clock::time_point sent;
+	LoadEvent event = LOAD_PERIODIC;
+
+	LoadConnection(LoadGenerator &g, boost::asio::io_context &io);
+	void connect();
+	void send(string &&req, LoadEvent ev, Clock::time_point due);
+	void time_out();
+};
+
+class LoadGenerator {
+private:
+	boost::asio::io_context &io;
+	LoadOptions opts;
+	mt19937_64 rng{random_device{}()};
+	vector<SimClient> clients;
+	vector<unique_ptr<LoadConnection>> conns;
+	deque<Clock::time_point> backlog; /* due announces waiting for an idle connection */
+	boost::asio::steady_timer tick;
+	Clock::time_point start;
+	uint64_t scheduled_count = 0;
+	bool stopping = false;
+
+	void new_identity(SimClient &client);
+	LoadEvent next_request(SimClient &client, string &out);
+	void schedule();
+
+public:
+	tcp::resolver::results_type endpoints;
+	vector<uint64_t> latencies; /* ns, from due time to answer */
+	size_t sent = 0;
+	size_t answered = 0;
+	size_t per_event[NUM_LOAD_EVENTS] = {};
+	size_t connect_errors = 0;
+	size_t http_errors = 0;
+	size_t tracker_failures = 0;
+	size_t timeouts = 0;
+
+	LoadGenerator(boost::asio::io_context &io, const LoadOptions &opts);
+	void run();
+	void dispatch();
+	void report() const;
+};
+
+LoadConnection::LoadConnection(LoadGenerator &g, boost::asio::io_context &io)
+	: gen(g), socket(io), retry(io) {}
+
+void LoadConnection::connect()
+{
+	boost::asio::async_connect(socket, gen.endpoints,
+		[this](const boost::system::error_code &ec, const tcp::endpoint &) {
+			if (ec) {
+				gen.connect_errors++;
+				retry.expires_after(chrono::milliseconds(100));
+				retry.async_wait([this](const boost::system::error_code &ec) {
+					if (!ec) connect();
+				});
+				return;
+			}
+			socket.set_option(tcp::no_delay(true));
+			received.clear();
+			ready = true;
+			do_read();
+			gen.dispatch();
+		});
+}
+
+void LoadConnection::send(string &&req, LoadEvent ev, Clock::time_point due)
+{
+	request = std::move(req);
+	event = ev;
+	scheduled = due;
+	sent = Clock::now();
+	ready = false;
+	busy = true;
+	boost::asio::async_write(socket, boost::asio::buffer(request),
+		[this](const boost::system::error_code &ec, size_t) {
+			if (ec) fail(&LoadGenerator::http_errors);
+		});
+}
+
+/* Reads run for the life of the connection; a response is only expected while busy */
+void LoadConnection::do_read()
+{
+	socket.async_read_some(boost::asio::buffer(chunk),
+		[this](const boost::system::error_code &ec, size_t n) {
+			if (ec) {
+				if (ec != boost::asio::error::operation_aborted) {
+					fail(&LoadGenerator::http_errors);
+				}
+				return;
+			}
+			received.append(chunk.data(), n);
+
+			string_view body;
+			size_t consumed;
+			HttpParseResult result = parse_http_response(received.data(), received.size(), body, consumed);
+			if (result == HTTP_PARSE_INCOMPLETE) {
+				do_read();
+				return;
+			}
+			if (result == HTTP_PARSE_ERROR || !busy) {
+				fail(&LoadGenerator::http_errors);
+				return;
+			}
+
+			if (body.find("14:failure reason") != string_view::npos) {
+				gen.tracker_failures++;
+			} else {
+				gen.answered++;
+				gen.per_event[event]++;
+				gen.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - scheduled).count());
+			}
+			received.erase(0, consumed);
+			busy = false;
+			ready = true;
+			do_read();
+			gen.dispatch();
+		});
+}
+
+/* Count the announce in flight (if any) against counter, then start over on a new socket */
+void LoadConnection::fail(size_t LoadGenerator::*counter)
+{
+	if (busy) {
+		gen.*counter += 1;
+	}
+	busy = false;
+	ready = false;
+	boost::system::error_code ignored;
+	socket.close(ignored);
+	connect();
+}
+
+void LoadConnection::time_out()
+{
+	if (busy && Clock::now() - sent > chrono::seconds(LOADGEN_TIMEOUT)) {
+		fail(&LoadGenerator::timeouts);
+	}
+}
+
+LoadGenerator::LoadGenerator(boost::asio::io_context &context, const LoadOptions &options)
+	: io(context), opts(options), tick(context)
+{
+	tcp::resolver resolver(io);
+	endpoints = resolver.resolve(opts.host, opts.port);
+
+	/* Torrent t's info_hash is sha1("loadgen torrent t"), so reruns hit the same swarms */
+	vector<string> info_hashes;
+	for (size_t t = 0; t < opts.torrents; t++) {
+		info_hashes.push_back(url_encode(sha1_hash("loadgen torrent " + to_string(t))));
+	}
+
+	clients.resize(opts.clients);
+	for (size_t i = 0; i < clients.size(); i++) {
+		clients[i].info_hash = info_hashes[i % info_hashes.size()];
+		clients[i].port = static_cast<uint16_t>(1024 + i % 60000);
+		new_identity(clients[i]);
+		/* Spread the starting points, so the first second isn't all "started" */
+		clients[i].step = uniform_int_distribution<int>(0, clients[i].leech_steps + clients[i].seed_steps + 2)(rng);
+	}
+	for (size_t i = 0; i < opts.connections; i++) {
+		conns.push_back(make_unique<LoadConnection>(*this, io));
+	}
+}
+
+void LoadGenerator::new_identity(SimClient &client)
+{
+	string id = "-LG0001-";
+	for (int i = 0; i < 12; i++) {
+		id += static_cast<char>('0' + rng() % 10);
+	}
+	client.peer_id = url_encode(id);
+	client.step = 0;
+	client.leech_steps = 1 + rng() % LOADGEN_MAX_PERIODIC;
+	client.seed_steps = 1 + rng() % LOADGEN_MAX_PERIODIC;
+}
+
+/* The client's next announce as a request, advancing it one step */
+LoadEvent LoadGenerator::next_request(SimClient &client, string &out)
+{
+	int completed_step = client.leech_steps + 1;
+	int stopped_step = completed_step + client.seed_steps + 1;
+
+	LoadEvent event;
+	int64_t left;
+	if (client.step == 0) {
+		event = LOAD_STARTED;
+		left = LOADGEN_FILE_SIZE;
+	} else if (client.step < completed_step) {
+		event = LOAD_PERIODIC;
+		left = LOADGEN_FILE_SIZE - LOADGEN_FILE_SIZE * client.step / completed_step;
+	} else if (client.step == completed_step) {
+		event = LOAD_COMPLETED;
+		left = 0;
+	} else if (client.step < stopped_step) {
+		event = LOAD_PERIODIC;
+		left = 0;
+	} else {
+		event = LOAD_STOPPED;
+		left = 0;
+	}
+
+	out = "GET /announce?info_hash=";
+	out += client.info_hash;
+	out += "&peer_id=";
+	out += client.peer_id;
+	out += "&port=" + to_string(client.port);
+	out += "&uploaded=0&downloaded=" + to_string(LOADGEN_FILE_SIZE - left);
+	out += "&left=" + to_string(left);
+	out += "&compact=1&numwant=" + to_string(opts.numwant);
+	if (event != LOAD_PERIODIC) {
+		out += "&event=";
+		out += EVENT_NAMES[event];
+	}
+	out += " HTTP/1.1\r\nHost: ";
+	out += opts.host;
+	out += "\r\n\r\n";
+
+	if (event == LOAD_STOPPED) {
+		new_identity(client);
+	} else {
+		client.step++;
+	}
+	return event;
+}
+
+/*
+ * Open loop: the k-th announce is due at start + k / rate whatever the
+ * tracker is doing, and its latency counts from then. A slow tracker
+ * shows up as queueing in the latencies rather than as a lower send
+ * rate hiding the stall.
+ */
+void LoadGenerator::schedule()
+{
+	auto now = Clock::now();
+	double elapsed = chrono::duration<double>(now - start).count();
+	if (elapsed >= opts.duration) {
+		stopping = true;
+	} else {
+		uint64_t due = static_cast<uint64_t>(elapsed * opts.rate) + 1;
+		for (; scheduled_count < due; scheduled_count++) {
+			backlog.push_back(start + chrono::nanoseconds(static_cast<int64_t>(scheduled_count * 1e9 / opts.rate)));
+		}
+		dispatch();
+	}
+
+	for (auto &conn : conns) {
+		conn->time_out();
+	}
+
+	bool in_flight = any_of(conns.begin(), conns.end(), [](const auto &c) { return c->busy; });
+	if (stopping && (!in_flight || elapsed >= opts.duration + LOADGEN_TIMEOUT)) {
+		io.stop();
+		return;
+	}
+	/* Wake when the next announce is due, so the scheduler adds little of its own delay */
+	auto next_due = start + chrono::nanoseconds(static_cast<int64_t>(scheduled_count * 1e9 / opts.rate));
+	auto earliest = Clock::now() + chrono::microseconds(LOADGEN_MIN_WAIT_US);
+	tick.expires_at(stopping ? Clock::now() + chrono::milliseconds(10) : max(next_due, earliest));
+	tick.async_wait([this](const boost::system::error_code &ec) {
+		if (!ec) schedule();
+	});
+}
+
+void LoadGenerator::dispatch()
+{
+	if (stopping) {
+		return;
+	}
+	string request;
+	for (auto &conn : conns) {
+		if (backlog.empty()) {
+			return;
+		}
+		if (!conn->ready) {
+			continue;
+		}
+		SimClient &client = clients[rng() % clients.size()];
+		LoadEvent event = next_request(client, request);
+		conn->send(std::move(request), event, backlog.front());
+		backlog.pop_front();
+		sent++;
+	}
+}
+
+void LoadGenerator::run()
+{
+	for (auto &conn : conns) {
+		conn->connect();
+	}
+	start = Clock::now();
+	schedule();
+	io.run();
+}
+
+static double percentile_ms(const vector<uint64_t> &sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t index = min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+	return sorted[index] / 1e6;
+}
+
+void LoadGenerator::report() const
+{
+	vector<uint64_t> sorted = latencies;
+	sort(sorted.begin(), sorted.end());
+
+	printf("target %.0f announces/s for %d s over %zu connections, %zu clients in %zu torrents\n",
+		   opts.rate, opts.duration, opts.connections, opts.clients, opts.torrents);
+	printf("sent %zu, answered %zu (%.0f/s)", sent, answered, answered / static_cast<double>(opts.duration));
+	if (!backlog.empty()) {
+		printf(", %zu never sent (behind schedule)", backlog.size());
+	}
+	printf("\n");
+	printf("latency ms: p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+		   percentile_ms(sorted, 0.50), percentile_ms(sorted, 0.99), percentile_ms(sorted, 0.999),
+		   sorted.empty() ? 0.0 : sorted.back() / 1e6);
+	printf("announces:");
+	for (int e = 0; e < NUM_LOAD_EVENTS; e++) {
+		printf(" %s %zu", EVENT_NAMES[e], per_event[e]);
+	}
+	printf("\n");
+	printf("errors: connect %zu  http %zu  tracker failure %zu  timeout %zu\n",
+		   connect_errors, http_errors, tracker_failures, timeouts);
+}
+
+int main(int argc, char *argv[])
+{
+	LoadOptions opts;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		bool has_value = i + 1 < argc;
+		if (arg == "--host" && has_value) {
+			opts.host = argv[++i];
+		} else if (arg == "--port" && has_value) {
+			opts.port = argv[++i];
+		} else if (arg == "--clients" && has_value) {
+			opts.clients = max(1L, atol(argv[++i]));
+		} else if (arg == "--torrents" && has_value) {
+			opts.torrents = max(1L, atol(argv[++i]));
+		} else if (arg == "--rate" && has_value) {
+			opts.rate = max(1.0, atof(argv[++i]));
+		} else if (arg == "--duration" && has_value) {
+			opts.duration = max(1, atoi(argv[++i]));
+		} else if (arg == "--connections" && has_value) {
+			opts.connections = max(1L, atol(argv[++i]));
+		} else if (arg == "--numwant" && has_value) {
+			opts.numwant = atoi(argv[++i]);
+		} else {
+			cout << "usage: " << argv[0] << " [--host <host>] [--port <port>] [--clients <n>] "
+				 << "[--torrents <m>] [--rate <announces_per_sec>] [--duration <secs>] "
+				 << "[--connections <n>] [--numwant <n>]" << endl;
+			return 1;
+		}
+	}
+
+	try {
+		boost::asio::io_context io;
+		LoadGenerator gen(io, opts);
+		gen.run();
+		gen.report();
+	} catch (const exception &e) {
+		cerr << "Error: " << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+#include <tracker_metrics.hpp>
+#include <tracker.hpp>
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct CounterInfo {
+	const char *name;
+	const char *help;
+	const char *labels;
+};
+
+/* Indexed by MetricCounter; counters sharing a name must be adjacent */
+static const CounterInfo COUNTERS[NUM_METRIC_COUNTERS] = {
+	{"tracker_announces_total", "Announces handled.", "protocol=\"http\",event=\"none\""},
+	{"tracker_announces_total", "", "protocol=\"http\",event=\"completed\""},
+	{"tracker_announces_total", "", "protocol=\"http\",event=\"started\""},
+	{"tracker_announces_total", "", "protocol=\"http\",event=\"stopped\""},
+	{"tracker_announces_total", "", "protocol=\"udp\",event=\"none\""},
+	{"tracker_announces_total", "", "protocol=\"udp\",event=\"completed\""},
+	{"tracker_announces_total", "", "protocol=\"udp\",event=\"started\""},
+	{"tracker_announces_total", "", "protocol=\"udp\",event=\"stopped\""},
+	{"tracker_scrapes_total", "Scrape requests handled.", "protocol=\"http\""},
+	{"tracker_scrapes_total", "", "protocol=\"udp\""},
+	{"tracker_scraped_torrents_total", "Torrents reported across all scrapes.", ""},
+	{"tracker_udp_connects_total", "UDP connection ids handed out.", ""},
+	{"tracker_connections_total", "TCP connections accepted.", ""},
+	{"tracker_expired_peers_total", "Peers dropped for not announcing in time.", ""},
+	{"tracker_errors_total", "Requests refused or failed.", "kind=\"bad_http\""},
+	{"tracker_errors_total", "", "kind=\"bad_announce\""},
+	{"tracker_errors_total", "", "kind=\"bad_scrape\""},
+	{"tracker_errors_total", "", "kind=\"bad_udp\""},
+	{"tracker_errors_total", "", "kind=\"exception\""},
+};
+
+struct HistogramInfo {
+	const char *name;
+	const char *help;
+	const char *labels;
+	const uint64_t *bounds; /* ascending, 0-terminated, in observed units */
+	double scale; /* observed units to exposed units */
+};
+
+static const uint64_t LATENCY_BOUNDS[] = {
+	5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 100000000, 0
+};
+static const uint64_t SIZE_BOUNDS[] = {64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 0};
+
+/* Indexed by MetricHistogram; same adjacency rule as COUNTERS */
+static const HistogramInfo HISTOGRAMS[NUM_METRIC_HISTOGRAMS] = {
+	{"tracker_request_duration_seconds", "Time to handle a request, from parsed to response built.",
+	 "protocol=\"http\",request=\"announce\"", LATENCY_BOUNDS, 1e-9},
+	{"tracker_request_duration_seconds", "", "protocol=\"udp\",request=\"announce\"", LATENCY_BOUNDS, 1e-9},
+	{"tracker_request_duration_seconds", "", "protocol=\"http\",request=\"scrape\"", LATENCY_BOUNDS, 1e-9},
+	{"tracker_request_duration_seconds", "", "protocol=\"udp\",request=\"scrape\"", LATENCY_BOUNDS, 1e-9},
+	{"tracker_response_bytes", "Size of response bodies (UDP: whole datagrams).",
+	 "protocol=\"http\",request=\"announce\"", SIZE_BOUNDS, 1},
+	{"tracker_response_bytes", "", "protocol=\"udp\",request=\"announce\"", SIZE_BOUNDS, 1},
+	{"tracker_response_bytes", "", "protocol=\"http\",request=\"scrape\"", SIZE_BOUNDS, 1},
+	{"tracker_response_bytes", "", "protocol=\"udp\",request=\"scrape\"", SIZE_BOUNDS, 1},
+};
+
+/* One thread's numbers, on cache lines of its own */
+struct alignas(64) ThreadMetrics {
+	std::atomic<uint64_t> counters[NUM_METRIC_COUNTERS] = {};
+	std::atomic<uint64_t> buckets[NUM_METRIC_HISTOGRAMS][METRIC_MAX_BUCKETS + 1] = {};
+	std::atomic<uint64_t> sums[NUM_METRIC_HISTOGRAMS] = {};
+};
+
+/* Blocks outlive their threads, so totals never go backwards */
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadMetrics>> registry;
+
+static ThreadMetrics &thread_metrics()
+{
+	thread_local ThreadMetrics *mine = []() {
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		registry.push_back(std::make_unique<ThreadMetrics>());
+		return registry.back().get();
+	}();
+	return *mine;
+}
+
+/* Only the owning thread writes, so a plain load and store is enough */
+static void bump(std::atomic<uint64_t> &value, uint64_t n)
+{
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void metric_count(MetricCounter counter, uint64_t n)
+{
+	bump(thread_metrics().counters[counter], n);
+}
+
+void metric_observe(MetricHistogram histogram, uint64_t value)
+{
+	const uint64_t *bounds = HISTOGRAMS[histogram].bounds;
+	size_t bucket = 0;
+	while (bounds[bucket] != 0 && value > bounds[bucket]) {
+		bucket++;
+	}
+	ThreadMetrics &metrics = thread_metrics();
+	bump(metrics.buckets[histogram][bucket], 1);
+	bump(metrics.sums[histogram], value);
+}
+
+static void append_number(std::string &out, double value)
+{
+	char buf[32];
+	auto res = std::to_chars(buf, buf + sizeof(buf), value);
+	out.append(buf, res.ptr);
+}
+
+static void append_number(std::string &out, uint64_t value)
+{
+	char buf[24];
+	auto res = std::to_chars(buf, buf + sizeof(buf), value);
+	out.append(buf, res.ptr);
+}
+
+static void append_header(std::string &out, const char *name, const char *help, const char *type)
+{
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+/* name{labels} value, with extra appended to the labels if given */
+static void append_sample(std::string &out, const std::string &name, const char *labels,
+						  const std::string &extra, const std::string &value)
+{
+	out += name;
+	if (*labels || !extra.empty()) {
+		out += '{';
+		out += labels;
+		if (*labels && !extra.empty()) out += ',';
+		out += extra;
+		out += '}';
+	}
+	out += ' ';
+	out += value;
+	out += '\n';
+}
+
+static std::string number(double value)
+{
+	std::string s;
+	append_number(s, value);
+	return s;
+}
+
+static std::string number(uint64_t value)
+{
+	std::string s;
+	append_number(s, value);
+	return s;
+}
+
+void append_metrics(const Tracker &tracker, std::string &out)
+{
+	uint64_t counters[NUM_METRIC_COUNTERS] = {};
+	uint64_t buckets[NUM_METRIC_HISTOGRAMS][METRIC_MAX_BUCKETS + 1] = {};
+	uint64_t sums[NUM_METRIC_HISTOGRAMS] = {};
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (const auto &metrics : registry) {
+			for (int c = 0; c < NUM_METRIC_COUNTERS; c++) {
+				counters[c] += metrics->counters[c].load(std::memory_order_relaxed);
+			}
+			for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++) {
+				for (int b = 0; b <= METRIC_MAX_BUCKETS; b++) {
+					buckets[h][b] += metrics->buckets[h][b].load(std::memory_order_relaxed);
+				}
+				sums[h] += metrics->sums[h].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	for (int c = 0; c < NUM_METRIC_COUNTERS; c++) {
+		const CounterInfo &info = COUNTERS[c];
+		if (c == 0 || std::string(info.name) != COUNTERS[c - 1].name) {
+			append_header(out, info.name, info.help, "counter");
+		}
+		append_sample(out, info.name, info.labels, "", number(counters[c]));
+	}
+
+	/* Buckets are cumulative in the exposition format */
+	for (int h = 0; h < NUM_METRIC_HISTOGRAMS; h++) {
+		const HistogramInfo &info = HISTOGRAMS[h];
+		if (h == 0 || std::string(info.name) != HISTOGRAMS[h - 1].name) {
+			append_header(out, info.name, info.help, "histogram");
+		}
+		std::string name = info.name;
+		uint64_t count = 0;
+		size_t b = 0;
+		for (; info.bounds[b] != 0; b++) {
+			count += buckets[h][b];
+			append_sample(out, name + "_bucket", info.labels,
+						  "le=\"" + number(info.bounds[b] * info.scale) + "\"", number(count));
+		}
+		count += buckets[h][b];
+		append_sample(out, name + "_bucket", info.labels, "le=\"+Inf\"", number(count));
+		append_sample(out, name + "_sum", info.labels, "", number(sums[h] * info.scale));
+		append_sample(out, name + "_count", info.labels, "", number(count));
+	}
+
+	TrackerTotals totals = tracker.totals();
+	append_header(out, "tracker_torrents", "Torrents with at least one peer.", "gauge");
+	append_sample(out, "tracker_torrents", "", "", number(static_cast<uint64_t>(totals.torrents)));
+	append_header(out, "tracker_peers", "Peers currently in a swarm.", "gauge");
+	append_sample(out, "tracker_peers", "state=\"seeder\"", "", number(static_cast<uint64_t>(totals.seeders)));
+	append_sample(out, "tracker_peers", "state=\"leecher\"", "",
+				  number(static_cast<uint64_t>(totals.peers - totals.seeders)));
+	append_header(out, "tracker_announce_interval_seconds", "Base interval handed out before jitter.", "gauge");
+	append_sample(out, "tracker_announce_interval_seconds", "", "",
+				  number(static_cast<uint64_t>(tracker.current_interval())));
+}
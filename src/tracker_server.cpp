@@ -1,118 +1,526 @@
-#include <bencode.hpp>
 #include <tracker.hpp>
+#include <udp_tracker.hpp>
+#include <tracker_store.hpp>
+#include <tracker_metrics.hpp>
+#include <cluster_front.hpp>
 #include <boost/asio.hpp>
-#include <boost/algorithm/string/predicate.hpp>
 #include <iostream>
-#include <utils.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <http_parser.hpp>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <sys/resource.h>
 
 using namespace std;
 using boost::asio::ip::tcp;
 
+/* Drop clients that stay idle (or mid-request) this long */
+#define CLIENT_TIMEOUT 10
+/* Largest request head, plus whatever pipelined requests fit behind it */
+#define REQUEST_BUFFER_SIZE 8192
 
+/* A cluster front whose X-Forwarded-For we believe (--forwarded-by), unset otherwise */
+static boost::asio::ip::address trusted_proxy;
 
-void send_response(tcp::socket &socket, const string &data)
+/* Print every announce (--log-announces); off by default, /metrics has the totals */
+static bool log_announces = false;
+
+/* Print every refused request (--log-errors); off by default, tracker_errors_total counts them */
+static bool log_errors = false;
+
+/*
+ * Scrape for any number of info_hash parameters. Dashboards poll this
+ * for many torrents at once, so it only reads counters and logs nothing.
+ */
+bool handle_scrape_request(const HttpRequest &request, Tracker &tracker, string &body)
 {
-	string http_header = "HTTP/1.1 200 OK \r\n";
-	http_header += "Content-Type: text/plain\r\n";
-	http_header += "Content-Length: " + to_string(data.size()) + "\r\n";
-	http_header += "\r\n";
+	thread_local vector<Id20> info_hashes;
+	info_hashes.clear();
 
-	boost::asio::write(socket, boost::asio::buffer(http_header));
-	boost::asio::write(socket, boost::asio::buffer(data));
+	string_view query = request.query, key, value;
+	while (next_query_param(query, key, value)) {
+		if (key != "info_hash") {
+			continue;
+		}
+		Id20 info_hash;
+		if (!url_decode_fixed(value, info_hash.data(), info_hash.size())) {
+			if (log_errors) {
+				std::cerr << "Bad scrape request: Invalid info_hash\n";
+			}
+			metric_count(METRIC_BAD_SCRAPES);
+			return false;
+		}
+		info_hashes.push_back(info_hash);
+	}
+	if (info_hashes.empty()) {
+		if (log_errors) {
+			std::cerr << "Bad scrape request: Missing info_hash\n";
+		}
+		metric_count(METRIC_BAD_SCRAPES);
+		return false;
+	}
+
+	metric_count(METRIC_HTTP_SCRAPES);
+	metric_count(METRIC_SCRAPED_TORRENTS, info_hashes.size());
+	tracker.handle_scrape(info_hashes, body);
+	return true;
 }
 
-void handle_client(tcp::socket &socket, Tracker &tracker)
+bool handle_announce_request(const HttpRequest &request, const boost::asio::ip::address &ip,
+							 Tracker &tracker, string &body)
 {
-	try {
-	
-		boost::asio::streambuf buffer;
-		boost::asio::read_until(socket, buffer, "\r\n\r\n"); /* End of HTTP header */
-	
-		istream request_stream(&buffer);
-		string request_line;
-		getline(request_stream, request_line);
-
-		if (request_line.back() == '\r') {
-			request_line.pop_back();
+	AnnounceRequest announce;
+	if (const char *error = parse_announce_query(request.query, announce)) {
+		if (log_errors) {
+			std::cerr << "Bad announce request: " << error << "\n";
 		}
+		metric_count(METRIC_BAD_ANNOUNCES);
+		return false;
+	}
+
+	if (log_announces) {
+		string_view info_hash(announce.info_hash.data(), announce.info_hash.size());
+		string_view peer_id(announce.peer_id.data(), announce.peer_id.size());
+
+		std::cout << "peer connected: info_hash=" << info_hash
+				  << " peer_id=" << peer_id
+				  << " port=" << announce.port
+				  << " uploaded=" << announce.uploaded
+				  << " downloaded=" << announce.downloaded
+				  << " left=" << announce.left
+				  << " event=" << announce.event
+				  << "\n";
+	}
 
-		HttpRequest request = parse_http_request_line(request_line);
+	PeerRecord peer;
+	peer.peer_id = announce.peer_id;
+	peer.set_address(ip);
+	peer.port = announce.port;
+	peer.event = parse_event(announce.event);
+	peer.flags |= announce.has_left && announce.left == 0 ? PEER_SEED : 0;
+	metric_count(static_cast<MetricCounter>(METRIC_HTTP_ANNOUNCES + peer.event));
+	tracker.handle_announce(announce.info_hash, peer, announce.compact, announce.numwant, body);
+	return true;
+}
 
-		if (request.method != "GET") {
+/*
+ * Run one parsed request against the tracker and append the full HTTP
+ * response to out. Paths ending in /scrape are scrapes (the convention
+ * clients use to derive the scrape URL), /metrics is the Prometheus
+ * endpoint and anything else an announce. Returns false if the request
+ * was malformed and the connection should just be dropped.
+ */
+bool handle_request(const HttpRequest &request, const boost::asio::ip::address &ip, Tracker &tracker, string &out)
+{
+	if (request.method != "GET") {
+		if (log_errors) {
 			std::cerr << "Bad request: not GET" << endl;
-			return;
 		}
+		metric_count(METRIC_BAD_HTTP);
+		return false;
+	}
+
+	/* Reused across requests on this thread, so steady state allocates nothing */
+	thread_local string body;
+	body.clear();
+
+	string_view path = request.path;
+	if (path == "/metrics") {
+		append_metrics(tracker, body);
+		append_response(out, body, request.keep_alive);
+		return true;
+	}
+
+	auto start = chrono::steady_clock::now();
+	bool scrape = path.size() >= 7 && path.substr(path.size() - 7) == "/scrape";
+	if (scrape ? !handle_scrape_request(request, tracker, body)
+			   : !handle_announce_request(request, ip, tracker, body)) {
+		return false;
+	}
+	metric_observe(scrape ? METRIC_HTTP_SCRAPE_LATENCY : METRIC_HTTP_ANNOUNCE_LATENCY, metric_elapsed_ns(start));
+	metric_observe(scrape ? METRIC_HTTP_SCRAPE_BYTES : METRIC_HTTP_ANNOUNCE_BYTES, body.size());
+	append_response(out, body, request.keep_alive);
+	return true;
+}
+
+/*
+ * One accepted connection. Every pending handler holds a shared_ptr to
+ * the session, so it lives exactly as long as there is I/O in flight.
+ *
+ * Connections are kept alive (HTTP/1.1) and requests may be pipelined:
+ * every complete request in the buffer is answered, and the responses go
+ * out together in one write.
+ */
+class TrackerSession : public enable_shared_from_this<TrackerSession> {
+private:
+	tcp::socket socket;
+	Tracker &tracker;
+	boost::asio::ip::address remote_ip;
+	array<char, REQUEST_BUFFER_SIZE> buffer;
+	size_t buffered = 0;
+	boost::asio::steady_timer deadline;
+	string response;
+	bool closing = false;
+
+	boost::asio::ip::address client_address(const HttpRequest &request) const;
+	void arm_deadline();
+	void do_read();
+	void process_requests();
+	void do_write();
+	void close();
+
+public:
+	TrackerSession(tcp::socket sock, Tracker &t);
+	void start();
+};
+
+TrackerSession::TrackerSession(tcp::socket sock, Tracker &t)
+	: socket(std::move(sock)), tracker(t), deadline(socket.get_executor()) {}
+
+void TrackerSession::start()
+{
+	boost::system::error_code ec;
+	auto remote = socket.remote_endpoint(ec);
+	if (ec) {
+		close();
+		return;
+	}
+	remote_ip = remote.address();
+	do_read();
+}
+
+/* The announcing peer: us talking to it directly, or whoever the cluster front says */
+boost::asio::ip::address TrackerSession::client_address(const HttpRequest &request) const
+{
+	if (request.forwarded_for.empty() || trusted_proxy.is_unspecified() || remote_ip != trusted_proxy) {
+		return remote_ip;
+	}
+	boost::system::error_code ec;
+	auto forwarded = boost::asio::ip::make_address(request.forwarded_for, ec);
+	return ec ? remote_ip : forwarded;
+}
+
+void TrackerSession::arm_deadline()
+{
+	auto self = shared_from_this();
+	deadline.expires_after(chrono::seconds(CLIENT_TIMEOUT));
+	deadline.async_wait([this, self](const boost::system::error_code &ec) {
+		if (ec != boost::asio::error::operation_aborted) {
+			close();
+		}
+	});
+}
+
+void TrackerSession::do_read()
+{
+	if (buffered == buffer.size()) {
+		if (log_errors) {
+			std::cerr << "Bad request: header too large" << endl;
+		}
+		metric_count(METRIC_BAD_HTTP);
+		close();
+		return;
+	}
+
+	arm_deadline();
+	auto self = shared_from_this();
+	socket.async_read_some(boost::asio::buffer(buffer.data() + buffered, buffer.size() - buffered),
+		[this, self](const boost::system::error_code &ec, size_t n) {
+			if (ec) {
+				deadline.cancel();
+				close();
+				return;
+			}
+			buffered += n;
+			process_requests();
+		});
+}
+
+void TrackerSession::process_requests()
+{
+	response.clear();
+	size_t offset = 0;
+
+	while (!closing) {
+		HttpRequest request;
+		size_t consumed;
+		HttpParseResult result = parse_http_request(buffer.data() + offset, buffered - offset,
+													request, consumed);
+		if (result == HTTP_PARSE_INCOMPLETE) {
+			break;
+		}
+		if (result == HTTP_PARSE_ERROR) {
+			if (log_errors) {
+				std::cerr << "Bad request: malformed HTTP" << endl;
+			}
+			metric_count(METRIC_BAD_HTTP);
+			closing = true;
+			break;
+		}
+		offset += consumed;
 
- 		auto params = parse_query_params(request.query);
+		try {
+			if (!handle_request(request, client_address(request), tracker, response)) {
+				closing = true;
+			}
+		} catch (const exception &e) {
+			if (log_errors) {
+				std::cerr << "exception handling client: " << e.what() << endl;
+			}
+			metric_count(METRIC_EXCEPTIONS);
+			closing = true;
+		}
+		if (!request.keep_alive) {
+			closing = true;
+		}
+	}
 
-        /* Extract required components safely */
-        std::string info_hash, peer_id, event = "";
-        uint16_t port = 0;
-        int64_t uploaded = 0, downloaded = 0, left = 0;
+	/* Keep any partial request at the front for the next read */
+	memmove(buffer.data(), buffer.data() + offset, buffered - offset);
+	buffered -= offset;
 
-        try {
-            if (params.count("info_hash") != 1 || params["info_hash"].size() != 20) throw std::runtime_error("Invalid info_hash");
-            info_hash = params["info_hash"];
+	if (!response.empty()) {
+		do_write();
+	} else if (closing) {
+		deadline.cancel();
+		close();
+	} else {
+		do_read();
+	}
+}
+
+void TrackerSession::do_write()
+{
+	auto self = shared_from_this();
+	boost::asio::async_write(socket, boost::asio::buffer(response),
+		[this, self](const boost::system::error_code &ec, size_t) {
+			if (ec || closing) {
+				deadline.cancel();
+				close();
+				return;
+			}
+			do_read();
+		});
+}
+
+void TrackerSession::close()
+{
+	boost::system::error_code ignored;
+	socket.shutdown(tcp::socket::shutdown_both, ignored);
+	socket.close(ignored);
+}
+
+void do_accept(tcp::acceptor &acceptor, Tracker &tracker)
+{
+	/* Each session gets its own strand so its timer and socket handlers never overlap */
+	acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()),
+		[&acceptor, &tracker](const boost::system::error_code &ec, tcp::socket socket) {
+			if (!ec) {
+				metric_count(METRIC_CONNECTIONS);
+				make_shared<TrackerSession>(std::move(socket), tracker)->start();
+			} else if (ec == boost::asio::error::operation_aborted) {
+				return;
+			} else {
+				cerr << "accept error: " << ec.message() << endl;
+			}
+			do_accept(acceptor, tracker);
+		});
+}
 
-            if (params.count("peer_id") != 1 || params["peer_id"].size() != 20) throw std::runtime_error("Invalid peer_id");
-            peer_id = params["peer_id"];
+/* Threads run_io() runs the io_context on, one per core */
+static unsigned io_threads()
+{
+	return max(1u, thread::hardware_concurrency());
+}
 
-            if (params.count("port") != 1) throw std::runtime_error("Missing port");
-            port = static_cast<uint16_t>(std::stoi(params["port"]));
+/* CPU time (user + system) this process has used so far */
+static chrono::microseconds process_cpu_time()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+		   chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
 
-            if (params.count("uploaded")) uploaded = std::stoll(params["uploaded"]);
-            if (params.count("downloaded")) downloaded = std::stoll(params["downloaded"]);
-            if (params.count("left")) left = std::stoll(params["left"]);
-            if (params.count("event")) event = params["event"];
-        } catch (const std::exception& e) {
-            std::cerr << "Bad announce request: " << e.what() << "\n";
-            return;
-        }
+/*
+ * Once a second: expire peers, then hand the tracker the elapsed time and
+ * the share of all cores we used in it so it can re-derive the interval.
+ */
+void schedule_tick(boost::asio::steady_timer &timer, Tracker &tracker,
+				   chrono::steady_clock::time_point last_wall, chrono::microseconds last_cpu)
+{
+	timer.expires_after(chrono::seconds(1));
+	timer.async_wait([&timer, &tracker, last_wall, last_cpu](const boost::system::error_code &ec) {
+		if (ec) {
+			return;
+		}
+		size_t expired = tracker.expire_peers();
+		metric_count(METRIC_EXPIRED_PEERS, expired);
+		if (expired > 0) {
+			cout << "expired " << expired << " inactive peers" << endl;
+		}
 
-        std::cout << "peer connected: info_hash=" << info_hash
-                  << " peer_id=" << peer_id
-                  << " port=" << port
-                  << " uploaded=" << uploaded
-                  << " downloaded=" << downloaded
-                  << " left=" << left
-                  << " event=" << event
-                  << "\n";
+		auto wall = chrono::steady_clock::now();
+		auto cpu = process_cpu_time();
+		double seconds = chrono::duration<double>(wall - last_wall).count();
+		double cpu_load = chrono::duration<double>(cpu - last_cpu).count() /
+						  (seconds * io_threads());
+		int old_interval = tracker.current_interval();
+		tracker.update_load(seconds, cpu_load);
+		if (tracker.current_interval() != old_interval) {
+			cout << "announce interval now " << tracker.current_interval() << "s ("
+				 << static_cast<long>(tracker.current_announce_rate()) << " announces/s, cpu "
+				 << static_cast<int>(cpu_load * 100) << "%)" << endl;
+		}
+		schedule_tick(timer, tracker, wall, cpu);
+	});
+}
 
-		auto ip = socket.remote_endpoint().address().to_string();
-		string response = tracker.handle_announce(info_hash, peer_id, ip, port, event);
-		send_response(socket, response);
+/* Run io on one thread per core until SIGINT/SIGTERM */
+void run_io(boost::asio::io_context &io)
+{
+	boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+	signals.async_wait([&io](const boost::system::error_code &, int) {
+		io.stop();
+	});
 
-	} catch (const exception &e) {
-		std::cerr << "exception handling client: " << e.what() << endl;
+	/* Every thread runs the same io_context, handlers spread across them */
+	unsigned num_threads = io_threads();
+	vector<thread> workers;
+	for (unsigned i = 1; i < num_threads; i++) {
+		workers.emplace_back([&io]() { io.run(); });
+	}
+	io.run();
+	for (auto &t : workers) {
+		t.join();
 	}
 }
 
+/* "a,b,c" -> {"a", "b", "c"} */
+vector<string> split_list(const string &list)
+{
+	vector<string> items;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t comma = list.find(',', start);
+		if (comma == string::npos) comma = list.size();
+		if (comma > start) {
+			items.push_back(list.substr(start, comma - start));
+		}
+		start = comma + 1;
+	}
+	return items;
+}
+
+/* --locality-prefix "24" or "24,56" (IPv6 defaults to /64) and/or a --zone-map file */
+Locality make_locality(const string &prefixes, const string &zone_map)
+{
+	Locality locality;
+	if (!prefixes.empty()) {
+		vector<string> lengths = split_list(prefixes);
+		int v4 = lengths.empty() ? 0 : atoi(lengths[0].c_str());
+		int v6 = lengths.size() > 1 ? atoi(lengths[1].c_str()) : 64;
+		locality.set_prefixes(v4, v6);
+		cout << "peers in the same /" << v4 << " (IPv4) or /" << v6 << " (IPv6) count as local" << endl;
+	}
+	if (!zone_map.empty()) {
+		locality.load_zone_map(zone_map);
+		cout << "loaded " << locality.zone_count() << " zones from " << zone_map << endl;
+	}
+	return locality;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc > 2) {
-        cout << "usage: " << argv[0] << "<optional_tracker_port>" << endl;
+	/* Flags may appear anywhere, everything else is positional */
+	vector<string> args;
+	string state_dir, cluster, forwarded_by;
+	int target_rate = TARGET_ANNOUNCE_RATE;
+	string locality_prefix, zone_map;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		if (arg == "--state-dir" && i + 1 < argc) {
+			state_dir = argv[++i];
+		} else if (arg == "--cluster" && i + 1 < argc) {
+			cluster = argv[++i];
+		} else if (arg == "--forwarded-by" && i + 1 < argc) {
+			forwarded_by = argv[++i];
+		} else if (arg == "--target-rate" && i + 1 < argc) {
+			target_rate = atoi(argv[++i]);
+		} else if (arg == "--locality-prefix" && i + 1 < argc) {
+			locality_prefix = argv[++i];
+		} else if (arg == "--zone-map" && i + 1 < argc) {
+			zone_map = argv[++i];
+		} else if (arg == "--log-announces") {
+			log_announces = true;
+		} else if (arg == "--log-errors") {
+			log_errors = true;
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	if (args.size() > 1) {
+        cout << "usage: " << argv[0] << " <optional_tracker_port> [--state-dir <dir>] "
+             << "[--forwarded-by <front_ip>] [--cluster <host:port,...>] "
+             << "[--target-rate <announces_per_sec>] [--locality-prefix <v4_len>[,<v6_len>]] "
+             << "[--zone-map <file>] [--log-announces] [--log-errors]" << endl;
 		return 1;
 	}
-	
+
 	int tracker_port = 8080;
 
-	if (argc == 2) {
-		tracker_port = atoi(argv[1]);
+	if (args.size() == 1) {
+		tracker_port = atoi(args[0].c_str());
 	}
 
 	try {
 		boost::asio::io_context io;
+
+		if (!cluster.empty()) {
+			vector<string> nodes = split_list(cluster);
+			ClusterFront front(io, tracker_port, nodes);
+			cout << "cluster front listening on port " << tracker_port << " for "
+				 << nodes.size() << " nodes" << endl;
+			front.start();
+			run_io(io);
+			return 0;
+		}
+
+		if (!forwarded_by.empty()) {
+			trusted_proxy = boost::asio::ip::make_address(forwarded_by);
+		}
+
         tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), tracker_port));
 
-		cout << "tracker listening on port " << tracker_port << endl;
 		Tracker tracker;
-		while(1) {
-			tcp::socket socket(io);
-			acceptor.accept(socket);
-			auto remote_endpoint = socket.remote_endpoint();
-			string client_ip = remote_endpoint.address().to_string();
-			cout << "client connected: " << remote_endpoint <<  endl;
-			handle_client(socket, tracker);
+		tracker.set_target_rate(target_rate);
+		if (!locality_prefix.empty() || !zone_map.empty()) {
+			tracker.set_locality(make_locality(locality_prefix, zone_map));
+		}
+		unique_ptr<TrackerStore> store;
+		if (!state_dir.empty()) {
+			store = make_unique<TrackerStore>(state_dir, tracker);
+			store->load();
+			store->start();
+		}
+
+		cout << "tracker listening on port " << tracker_port << " (tcp and udp)" << endl;
+		do_accept(acceptor, tracker);
+
+		UdpTracker udp_tracker(io, tracker_port, tracker, io_threads() * UDP_RECEIVES_PER_THREAD);
+		udp_tracker.set_log_errors(log_errors);
+		udp_tracker.start();
+
+		boost::asio::steady_timer tick_timer(io);
+		schedule_tick(tick_timer, tracker, chrono::steady_clock::now(), process_cpu_time());
+
+		run_io(io);
+		if (store) {
+			store->stop();
 		}
 	} catch (std::exception& e) {
 	    cerr << "Error: " << e.what() << endl;
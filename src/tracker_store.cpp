@@ -0,0 +1,333 @@
+#include <tracker_store.hpp>
+#include <iostream>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Leads both files; record_size catches a PeerRecord layout change */
+struct StateHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t generation;
+};
+
+/* Precedes each torrent's peers in the snapshot */
+struct SnapshotTorrent {
+	Id20 info_hash;
+	uint32_t downloaded;
+	uint32_t count;
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'B', 'T', 'S', 'N', 'A', 'P', 0, 0};
+static const char JOURNAL_MAGIC[8] = {'B', 'T', 'J', 'R', 'N', 'L', 0, 0};
+
+static void write_all(int fd, const char *data, size_t len, const std::string &name)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error("unable to write " + name + ": " + strerror(errno));
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* Whole file into out; false if it doesn't exist */
+static bool read_file(const std::string &name, std::string &out)
+{
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return false;
+		throw std::runtime_error("unable to open " + name + ": " + strerror(errno));
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error("unable to stat " + name + ": " + strerror(errno));
+	}
+	out.resize(st.st_size);
+	size_t got = 0;
+	while (got < out.size()) {
+		ssize_t n = read(fd, out.data() + got, out.size() - got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += n;
+	}
+	out.resize(got);
+	close(fd);
+	return true;
+}
+
+static StateHeader make_header(const char *magic, uint32_t record_size, uint64_t generation)
+{
+	StateHeader header;
+	std::memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = STATE_FORMAT_VERSION;
+	header.record_size = record_size;
+	header.generation = generation;
+	return header;
+}
+
+static bool check_header(const std::string &data, const char *magic, uint32_t record_size, StateHeader &header)
+{
+	if (data.size() < sizeof(header)) {
+		return false;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
+	return std::memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+		   header.version == STATE_FORMAT_VERSION && header.record_size == record_size;
+}
+
+static long elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+TrackerStore::TrackerStore(const std::string &state_dir, Tracker &t)
+	: dir(state_dir), tracker(t)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	if (ec) {
+		throw std::runtime_error("unable to create " + dir + ": " + ec.message());
+	}
+}
+
+TrackerStore::~TrackerStore()
+{
+	stop();
+	if (journal_fd >= 0) {
+		close(journal_fd);
+	}
+}
+
+size_t TrackerStore::load_snapshot()
+{
+	std::string data;
+	if (!read_file(path("snapshot"), data)) {
+		return 0;
+	}
+
+	StateHeader header;
+	if (!check_header(data, SNAPSHOT_MAGIC, sizeof(PeerRecord), header)) {
+		std::cerr << "ignoring " << path("snapshot") << ": unrecognised format" << std::endl;
+		return 0;
+	}
+	generation = header.generation;
+
+	/* Peers are copied out one torrent at a time, the buffer may not be aligned for them */
+	std::vector<PeerRecord> peers;
+	size_t restored = 0;
+	size_t pos = sizeof(header);
+	while (pos < data.size()) {
+		SnapshotTorrent torrent;
+		if (data.size() - pos < sizeof(torrent)) {
+			break;
+		}
+		std::memcpy(&torrent, data.data() + pos, sizeof(torrent));
+		pos += sizeof(torrent);
+
+		size_t bytes = static_cast<size_t>(torrent.count) * sizeof(PeerRecord);
+		if (data.size() - pos < bytes) {
+			break;
+		}
+		peers.resize(torrent.count);
+		std::memcpy(peers.data(), data.data() + pos, bytes);
+		pos += bytes;
+
+		restored += tracker.restore_swarm(torrent.info_hash, torrent.downloaded, peers.data(), peers.size());
+	}
+	if (pos != data.size()) {
+		std::cerr << path("snapshot") << " is truncated, loaded what was there" << std::endl;
+	}
+	return restored;
+}
+
+size_t TrackerStore::replay_journal()
+{
+	std::string data;
+	if (!read_file(path("journal"), data)) {
+		return 0;
+	}
+
+	StateHeader header;
+	if (!check_header(data, JOURNAL_MAGIC, sizeof(JournalEntry), header) || header.generation != generation) {
+		std::cerr << "ignoring " << path("journal") << ": does not belong to the snapshot" << std::endl;
+		return 0;
+	}
+
+	/* A torn entry at the end (crash mid-write) is simply left out */
+	size_t replayed = 0;
+	for (size_t pos = sizeof(header); data.size() - pos >= sizeof(JournalEntry); pos += sizeof(JournalEntry)) {
+		JournalEntry entry;
+		std::memcpy(&entry, data.data() + pos, sizeof(entry));
+		tracker.replay_announce(entry);
+		replayed++;
+	}
+	journal_bytes = sizeof(header) + replayed * sizeof(JournalEntry);
+	return replayed;
+}
+
+void TrackerStore::load()
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t restored = load_snapshot();
+	size_t replayed = replay_journal();
+	std::cout << "restored " << restored << " peers from snapshot and replayed "
+			  << replayed << " announces in " << elapsed_ms(start) << " ms" << std::endl;
+}
+
+/*
+ * Start a new, empty journal for the current generation. It is built
+ * under a temporary name so a crash never leaves a journal without its
+ * header.
+ */
+void TrackerStore::open_journal()
+{
+	std::string tmp = path("journal.tmp");
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("unable to open " + tmp + ": " + strerror(errno));
+	}
+	StateHeader header = make_header(JOURNAL_MAGIC, sizeof(JournalEntry), generation);
+	try {
+		write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header), tmp);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	if (rename(tmp.c_str(), path("journal").c_str()) != 0) {
+		close(fd);
+		throw std::runtime_error("unable to rename " + tmp + ": " + strerror(errno));
+	}
+
+	if (journal_fd >= 0) {
+		close(journal_fd);
+	}
+	journal_fd = fd;
+	journal_bytes = sizeof(header);
+}
+
+void TrackerStore::flush_journal()
+{
+	pending.clear();
+	tracker.drain_journal(pending);
+	if (pending.empty()) {
+		return;
+	}
+	size_t bytes = pending.size() * sizeof(JournalEntry);
+	write_all(journal_fd, reinterpret_cast<const char*>(pending.data()), bytes, path("journal"));
+	journal_bytes += bytes;
+}
+
+/*
+ * Each shard is copied out under its own lock, which also discards the
+ * announces it had queued: the snapshot already reflects them, and the
+ * ones that arrive after go to the next generation's journal.
+ */
+void TrackerStore::write_snapshot()
+{
+	auto start = std::chrono::steady_clock::now();
+	std::string tmp = path("snapshot.tmp");
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("unable to open " + tmp + ": " + strerror(errno));
+	}
+
+	size_t peers = 0;
+	try {
+		StateHeader header = make_header(SNAPSHOT_MAGIC, sizeof(PeerRecord), generation + 1);
+		write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header), tmp);
+
+		std::string buf;
+		for (size_t i = 0; i < tracker.shard_count(); i++) {
+			buf.clear();
+			tracker.snapshot_shard(i, [&](const Id20 &info_hash, uint32_t downloaded,
+										  const PeerRecord *records, size_t count) {
+				SnapshotTorrent torrent{info_hash, downloaded, static_cast<uint32_t>(count)};
+				buf.append(reinterpret_cast<const char*>(&torrent), sizeof(torrent));
+				buf.append(reinterpret_cast<const char*>(records), count * sizeof(PeerRecord));
+				peers += count;
+			});
+			write_all(fd, buf.data(), buf.size(), tmp);
+		}
+		if (fsync(fd) != 0) {
+			throw std::runtime_error("unable to sync " + tmp + ": " + strerror(errno));
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+
+	if (rename(tmp.c_str(), path("snapshot").c_str()) != 0) {
+		throw std::runtime_error("unable to rename " + tmp + ": " + strerror(errno));
+	}
+	generation++;
+	open_journal();
+	std::cout << "snapshot of " << peers << " peers written in " << elapsed_ms(start) << " ms" << std::endl;
+}
+
+void TrackerStore::start()
+{
+	/* Keep appending to a journal that matched the snapshot, otherwise begin a fresh one */
+	int fd = journal_bytes > 0 ? open(path("journal").c_str(), O_WRONLY | O_APPEND) : -1;
+	if (fd >= 0 && ftruncate(fd, journal_bytes) == 0) {
+		journal_fd = fd;
+	} else {
+		if (fd >= 0) close(fd);
+		open_journal();
+	}
+
+	tracker.enable_journal();
+	worker = std::thread([this]() { run(); });
+}
+
+void TrackerStore::run()
+{
+	auto last_snapshot = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!wake.wait_for(lock, std::chrono::seconds(STATE_FLUSH_INTERVAL), [this]() { return stopping; })) {
+		lock.unlock();
+		try {
+			flush_journal();
+			if (journal_bytes >= STATE_MAX_JOURNAL ||
+				std::chrono::steady_clock::now() - last_snapshot >= std::chrono::seconds(STATE_SNAPSHOT_INTERVAL)) {
+				last_snapshot = std::chrono::steady_clock::now();
+				write_snapshot();
+			}
+		} catch (const std::exception &e) {
+			std::cerr << "state store: " << e.what() << std::endl;
+		}
+		lock.lock();
+	}
+}
+
+void TrackerStore::stop()
+{
+	if (!worker.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	worker.join();
+
+	try {
+		write_snapshot();
+	} catch (const std::exception &e) {
+		std::cerr << "state store: " << e.what() << std::endl;
+	}
+}
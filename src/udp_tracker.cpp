@@ -0,0 +1,244 @@
+#include <udp_tracker.hpp>
+#include <tracker.hpp>
+#include <tracker_metrics.hpp>
+#include <utils.hpp>
+#include <boost/endian/conversion.hpp>
+#include <iostream>
+#include <random>
+#include <cstring>
+
+using boost::asio::ip::udp;
+using boost::endian::load_big_u16;
+using boost::endian::load_big_u32;
+using boost::endian::load_big_u64;
+using boost::endian::store_big_u32;
+using boost::endian::store_big_u64;
+
+static void append_u32(std::string &out, uint32_t value)
+{
+	unsigned char buf[4];
+	store_big_u32(buf, value);
+	out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+}
+
+static void append_u64(std::string &out, uint64_t value)
+{
+	unsigned char buf[8];
+	store_big_u64(buf, value);
+	out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+}
+
+UdpTracker::UdpTracker(boost::asio::io_context &io, uint16_t port, Tracker &t, size_t in_flight)
+	: socket(io), tracker(t), receives(std::max<size_t>(1, in_flight))
+{
+	/* Dual-stack, so IPv4 clients arrive as v4-mapped addresses; plain IPv4 on hosts without IPv6 */
+	boost::system::error_code ec;
+	socket.open(udp::v6(), ec);
+	if (!ec) {
+		socket.set_option(boost::asio::ip::v6_only(false));
+		socket.bind(udp::endpoint(udp::v6(), port));
+		dual_stack = true;
+	} else {
+		socket.open(udp::v4());
+		socket.bind(udp::endpoint(udp::v4(), port));
+	}
+	socket.set_option(udp::socket::receive_buffer_size(UDP_SOCKET_BUFFER), ec);
+
+	std::random_device rd;
+	for (int i = 0; i < 4; i++) {
+		uint32_t word = rd();
+		secret.append(reinterpret_cast<const char*>(&word), sizeof(word));
+	}
+}
+
+void UdpTracker::start()
+{
+	for (auto &r : receives) {
+		do_receive(r);
+	}
+}
+
+uint64_t UdpTracker::connection_id(const udp::endpoint &ep, time_t window) const
+{
+	std::string key = secret;
+	key.append(reinterpret_cast<const char*>(&window), sizeof(window));
+	if (ep.address().is_v4()) {
+		auto bytes = ep.address().to_v4().to_bytes();
+		key.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	} else {
+		auto bytes = ep.address().to_v6().to_bytes();
+		key.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	}
+	uint16_t port = ep.port();
+	key.append(reinterpret_cast<const char*>(&port), sizeof(port));
+
+	uint64_t id;
+	std::memcpy(&id, sha1_hash(key).data(), sizeof(id));
+	return id;
+}
+
+/* Ids stay good for the rest of their minute and all of the next one */
+bool UdpTracker::valid_connection_id(uint64_t id, const udp::endpoint &ep) const
+{
+	time_t window = time(nullptr) / UDP_CONNECTION_TTL;
+	return id == connection_id(ep, window) || id == connection_id(ep, window - 1);
+}
+
+void UdpTracker::do_receive(Receive &r)
+{
+	socket.async_receive_from(boost::asio::buffer(r.packet), r.sender,
+		[this, &r](const boost::system::error_code &ec, size_t len) {
+			if (ec == boost::asio::error::operation_aborted) {
+				return;
+			}
+			r.reply.clear();
+			if (!ec) {
+				/* Peers are recorded, and connection ids keyed, by the plain IPv4 address */
+				auto address = r.sender.address();
+				if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+					r.sender.address(boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped,
+																	  address.to_v6()));
+				}
+				try {
+					handle_packet(r, len);
+				} catch (const std::exception &e) {
+					if (log_errors) {
+						std::cerr << "exception handling udp packet: " << e.what() << std::endl;
+					}
+					metric_count(METRIC_EXCEPTIONS);
+					r.reply.clear();
+				}
+			}
+			send_reply(r);
+		});
+}
+
+/* Send whatever the handler left in r.reply, then post r's next receive */
+void UdpTracker::send_reply(Receive &r)
+{
+	if (r.reply.empty()) {
+		do_receive(r);
+		return;
+	}
+	/* A v4 sender on the dual-stack socket has to be addressed v4-mapped again */
+	udp::endpoint to = r.sender;
+	if (dual_stack && to.address().is_v4()) {
+		to.address(boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, to.address().to_v4()));
+	}
+	socket.async_send_to(boost::asio::buffer(r.reply), to,
+		[this, &r](const boost::system::error_code &ec, size_t) {
+			if (ec == boost::asio::error::operation_aborted) {
+				return;
+			}
+			do_receive(r);
+		});
+}
+
+void UdpTracker::handle_packet(Receive &r, size_t len)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(r.packet.data());
+	/* Every request starts with connection_id, action, transaction_id */
+	if (len < 16) {
+		metric_count(METRIC_BAD_UDP);
+		return;
+	}
+
+	uint64_t id = load_big_u64(data);
+	uint32_t action = load_big_u32(data + 8);
+	uint32_t transaction_id = load_big_u32(data + 12);
+
+	if (action == UDP_ACTION_CONNECT) {
+		if (id != UDP_PROTOCOL_ID) {
+			metric_count(METRIC_BAD_UDP);
+			return;
+		}
+		metric_count(METRIC_UDP_CONNECTS);
+		append_u32(r.reply, UDP_ACTION_CONNECT);
+		append_u32(r.reply, transaction_id);
+		append_u64(r.reply, connection_id(r.sender, time(nullptr) / UDP_CONNECTION_TTL));
+		return;
+	}
+
+	if (!valid_connection_id(id, r.sender)) {
+		metric_count(METRIC_BAD_UDP);
+		set_error(r, transaction_id, "invalid connection id");
+		return;
+	}
+
+	if (action == UDP_ACTION_ANNOUNCE) {
+		handle_announce(r, len);
+	} else if (action == UDP_ACTION_SCRAPE) {
+		handle_scrape(r, len);
+	} else {
+		metric_count(METRIC_BAD_UDP);
+		set_error(r, transaction_id, "unknown action");
+	}
+}
+
+/*
+ * Announce layout: 16-byte header, info_hash, peer_id, downloaded, left,
+ * uploaded, event, ip, key, num_want, port (98 bytes). The ip field is
+ * ignored, peers are recorded at the address the datagram came from.
+ */
+void UdpTracker::handle_announce(Receive &r, size_t len)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(r.packet.data());
+	uint32_t transaction_id = load_big_u32(data + 12);
+	auto start = std::chrono::steady_clock::now();
+	if (len < 98) {
+		metric_count(METRIC_BAD_UDP);
+		set_error(r, transaction_id, "short announce");
+		return;
+	}
+
+	Id20 info_hash;
+	std::memcpy(info_hash.data(), data + 16, info_hash.size());
+
+	PeerRecord peer;
+	std::memcpy(peer.peer_id.data(), data + 36, peer.peer_id.size());
+	peer.set_address(r.sender.address());
+	peer.port = load_big_u16(data + 96);
+	uint32_t event_code = load_big_u32(data + 80);
+	peer.event = event_code <= UDP_EVENT_STOPPED ? static_cast<PeerEvent>(event_code) : EVENT_NONE;
+	peer.flags |= load_big_u64(data + 64) == 0 ? PEER_SEED : 0;
+	int32_t numwant = static_cast<int32_t>(load_big_u32(data + 92));
+
+	append_u32(r.reply, UDP_ACTION_ANNOUNCE);
+	append_u32(r.reply, transaction_id);
+	metric_count(static_cast<MetricCounter>(METRIC_UDP_ANNOUNCES + peer.event));
+	tracker.handle_udp_announce(info_hash, peer, numwant, r.reply);
+	metric_observe(METRIC_UDP_ANNOUNCE_LATENCY, metric_elapsed_ns(start));
+	metric_observe(METRIC_UDP_ANNOUNCE_BYTES, r.reply.size());
+}
+
+/* Scrape: 16-byte header then up to UDP_MAX_SCRAPE info_hashes */
+void UdpTracker::handle_scrape(Receive &r, size_t len)
+{
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(r.packet.data());
+	uint32_t transaction_id = load_big_u32(data + 12);
+	size_t count = std::min<size_t>((len - 16) / 20, UDP_MAX_SCRAPE);
+	auto start = std::chrono::steady_clock::now();
+
+	append_u32(r.reply, UDP_ACTION_SCRAPE);
+	append_u32(r.reply, transaction_id);
+	for (size_t i = 0; i < count; i++) {
+		Id20 info_hash;
+		std::memcpy(info_hash.data(), data + 16 + i * 20, info_hash.size());
+		ScrapeStats stats = tracker.scrape(info_hash);
+		append_u32(r.reply, stats.complete);
+		append_u32(r.reply, stats.downloaded);
+		append_u32(r.reply, stats.incomplete);
+	}
+	metric_count(METRIC_UDP_SCRAPES);
+	metric_count(METRIC_SCRAPED_TORRENTS, count);
+	metric_observe(METRIC_UDP_SCRAPE_LATENCY, metric_elapsed_ns(start));
+	metric_observe(METRIC_UDP_SCRAPE_BYTES, r.reply.size());
+}
+
+void UdpTracker::set_error(Receive &r, uint32_t transaction_id, const std::string &message)
+{
+	r.reply.clear();
+	append_u32(r.reply, UDP_ACTION_ERROR);
+	append_u32(r.reply, transaction_id);
+	r.reply += message;
+}
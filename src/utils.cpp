@@ -3,23 +3,12 @@
 #include <iomanip>
 #include <sstream>
 #include <random>
-#include <ctime>
+#include <charconv>
 
-HttpRequest parse_http_request_line(const std::string& request_line)
-{
-    std::istringstream line_stream(request_line);
-    HttpRequest req;
-    line_stream >> req.method >> req.path >> req.http_version;
-    auto qmark_pos = req.path.find('?');
-    if (qmark_pos != std::string::npos)
-        req.query = req.path.substr(qmark_pos + 1);
-    return req;
-}
-
-std::string sha1_hash(const std::string &data)
+std::string sha1_hash(std::string_view data)
 {
     unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char*)data.c_str(), data.length(), hash);
+    SHA1((const unsigned char*)data.data(), data.length(), hash);
     return std::string((char*)hash, SHA_DIGEST_LENGTH);
 }
 
@@ -51,29 +40,6 @@ std::string url_encode(const std::string &str)
     return escaped.str();
 }
 
-std::string url_decode(const std::string &str)
-{
-    std::string result;
-    for (size_t i = 0; i < str.length(); i++) {
-        if (str[i] == '%' && i + 2 < str.length()) {
-            int value;
-            std::istringstream is(str.substr(i + 1, 2));
-            if (is >> std::hex >> value) {
-                result += static_cast<char>(value);
-                i += 2;
-            } else {
-                result += str[i];
-            }
-        } else if (str[i] == '+') {
-            result += ' ';
-        } else {
-            result += str[i];
-        }
-    }
-
-    return result;
-}
-
 /* Grab host and port for resolution */
 URL parse_url(const std::string &url)
 {
@@ -81,6 +47,9 @@ URL parse_url(const std::string &url)
 
     size_t scheme_end = url.find("://");
     size_t host_start = (scheme_end == std::string::npos) ? 0 : scheme_end + 3;
+    if (scheme_end != std::string::npos) {
+        out.scheme = url.substr(0, scheme_end);
+    }
 
     size_t path_start = url.find('/', host_start);
     if (path_start == std::string::npos) {
@@ -100,24 +69,6 @@ URL parse_url(const std::string &url)
     return out;
 }
 
-std::unordered_map<std::string, std::string> parse_query_params(const std::string &query)
-{
-    std::unordered_map<std::string, std::string> params;
-    std::istringstream iss(query);
-    std::string pair;
-
-    while (std::getline(iss, pair, '&')) {
-        size_t eq_pos = pair.find('=');
-        if (eq_pos != std::string::npos) {
-            std::string key = pair.substr(0, eq_pos);
-            std::string value = url_decode(pair.substr(eq_pos + 1));
-            params[key] = value;
-        }
-    }
-
-    return params;
-}
-
 /*
  * Generate random peer_id (20 bytes)
  * Format: -PC0001-XXXXXXXXXXXX (per convention)
@@ -126,7 +77,7 @@ std::string generate_peer_id()
 {
     std::string peer_id = "-PC0001-";  /* Client ID: PC version 0.0.1 */
     const char charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-    std::mt19937 rng(std::time(nullptr));
+    std::random_device rng; /* not the clock: peers started in the same second would collide */
     std::uniform_int_distribution<> dist(0, sizeof(charset) - 2);
 
     for (int i = 0; i < 12; ++i) {
@@ -161,6 +112,7 @@ std::string build_announce_request(const std::string &announce_url,
     url << "&uploaded=" << uploaded;
     url << "&downloaded=" << downloaded;
     url << "&left=" << left;
+    url << "&compact=1";
 
     if (!event.empty()) {
         url << "&event=" << event;
@@ -170,32 +122,28 @@ std::string build_announce_request(const std::string &announce_url,
 }
 
 /*
- * Convert vector<bool> to packed bytes for wire protocol.
- * vector<bool> is weird and literally stores every bool as 1 bit
- * instead of a byte like most other instances of bool 
+ * Bencode writers for hot paths that build responses straight into a
+ * buffer instead of going through a bencode::dict.
  */
-std::string pack_bitfield(const std::vector<bool>& pieces)
+void append_bencode_int(std::string &out, long long value)
 {
-    std::string packed;
-    for (size_t i = 0; i < pieces.size(); i += 8) {
-        uint8_t byte = 0;
-        for (int bit = 0; bit < 8 && i + bit < pieces.size(); bit++) {
-            if (pieces[i + bit]) {
-                byte |= (1 << (7 - bit));
-            }
-        }
-        packed += byte;
-    }
-    return packed;
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    out += 'i';
+    out.append(buf, res.ptr);
+    out += 'e';
 }
 
-/* Same as above but opposite */
-std::vector<bool> unpack_bitfield(const std::string& packed, size_t num_pieces)
+void append_bencode_string_header(std::string &out, size_t length)
 {
-    std::vector<bool> pieces(num_pieces, false);
-    for (size_t i = 0; i < num_pieces && i / 8 < packed.size(); i++) {
-        uint8_t byte = packed[i / 8];
-        pieces[i] = (byte & (1 << (7 - (i % 8)))) != 0;
-    }
-    return pieces;
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), length);
+    out.append(buf, res.ptr);
+    out += ':';
+}
+
+void append_bencode_string(std::string &out, std::string_view str)
+{
+    append_bencode_string_header(out, str.size());
+    out.append(str);
 }